@@ -1,115 +1,1416 @@
 #include "linelib.h"
 
+// Every block starts with this header; the caller gets the memory after it.
+// mapped is 0 for malloc, 1 for mmap, 2 for mmap advised for THP and 3 for
+// explicit huge pages.
+struct line_mem_block
+{
+    long long size, map_size;
+    int component, mapped;
+    char pad[40];
+};
+
+static int line_mem_hugepage = LINE_HUGEPAGE_OFF;
+static bool line_mem_interleave = false;
+static long long line_mem_used[LINE_MEM_COMPONENTS], line_mem_peak[LINE_MEM_COMPONENTS], line_mem_huge[LINE_MEM_COMPONENTS];
+static const char *line_mem_name[LINE_MEM_COMPONENTS] = {"vectors", "graph", "samplers", "weights", "triples"};
+
+static void *line_mem_sampler_alloc(size_t size)
+{
+    return line_mem_alloc(size, LINE_MEM_SAMPLER);
+}
+
+static int line_mem_sampler_hook = (ransampl_set_allocator(line_mem_sampler_alloc, line_mem_free), 0);
+
+void line_mem_config(int hugepage, bool interleave)
+{
+    line_mem_hugepage = hugepage;
+    line_mem_interleave = interleave;
+}
+
+// Map map_size bytes at a 2 MB boundary and set mapped accordingly.
+static char *line_mem_map(long long map_size, int &mapped)
+{
+    char *raw, *base;
+    if (line_mem_hugepage == LINE_HUGEPAGE_EXPLICIT)
+    {
+        base = (char *)mmap(NULL, map_size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB, -1, 0);
+        if (base != MAP_FAILED)
+        {
+            mapped = 3;
+            return base;
+        }
+    }
+    raw = (char *)mmap(NULL, map_size + LINE_HUGEPAGE_SIZE, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (raw == MAP_FAILED) return NULL;
+    base = (char *)(((unsigned long long)raw + LINE_HUGEPAGE_SIZE - 1) & ~(unsigned long long)(LINE_HUGEPAGE_SIZE - 1));
+    if (base != raw) munmap(raw, base - raw);
+    munmap(base + map_size, raw + LINE_HUGEPAGE_SIZE - base);
+    mapped = 1;
+    if (line_mem_hugepage != LINE_HUGEPAGE_OFF && madvise(base, map_size, MADV_HUGEPAGE) == 0) mapped = 2;
+    return base;
+}
+
+void *line_mem_alloc(long long size, int component)
+{
+    line_mem_block *block;
+    long long map_size = 0;
+    int mapped = 0;
+    
+    if (size + (long long)sizeof(line_mem_block) >= LINE_HUGEPAGE_SIZE)
+    {
+        map_size = (size + sizeof(line_mem_block) + LINE_HUGEPAGE_SIZE - 1) / LINE_HUGEPAGE_SIZE * LINE_HUGEPAGE_SIZE;
+        block = (line_mem_block *)line_mem_map(map_size, mapped);
+        if (block != NULL && line_mem_interleave)
+        {
+            // MPOL_INTERLEAVE over every node we are allowed to use; only a hint
+            unsigned long mask = ~0UL;
+            syscall(SYS_mbind, block, map_size, 3, &mask, 8 * sizeof(mask), 0);
+        }
+    }
+    else block = (line_mem_block *)calloc(1, size + sizeof(line_mem_block));
+    if (block == NULL)
+    {
+        printf("ERROR: failed to allocate %lld bytes for %s!\n", size, line_mem_name[component]);
+        exit(1);
+    }
+    
+    block->size = size;
+    block->map_size = map_size;
+    block->component = component;
+    block->mapped = mapped;
+    
+    long long used = __sync_add_and_fetch(&line_mem_used[component], size);
+    // raise the peak unless another thread raised it past used in the meantime
+    long long peak = line_mem_peak[component];
+    while (used > peak && !__sync_bool_compare_and_swap(&line_mem_peak[component], peak, used)) peak = line_mem_peak[component];
+    if (mapped >= 2) __sync_add_and_fetch(&line_mem_huge[component], map_size);
+    return (char *)block + sizeof(line_mem_block);
+}
+
+void line_mem_free(void *ptr)
+{
+    if (ptr == NULL) return;
+    line_mem_block *block = (line_mem_block *)((char *)ptr - sizeof(line_mem_block));
+    __sync_sub_and_fetch(&line_mem_used[block->component], block->size);
+    if (block->mapped >= 2) __sync_sub_and_fetch(&line_mem_huge[block->component], block->map_size);
+    if (block->mapped) munmap(block, block->map_size);
+    else free(block);
+}
+
+void line_mem_report()
+{
+    long long used = 0, huge = 0;
+    printf("Memory usage:\n");
+    for (int c = 0; c != LINE_MEM_COMPONENTS; c++)
+    {
+        printf("\t%-10s %10.2f MB (peak %.2f MB, huge pages %.2f MB)\n", line_mem_name[c], line_mem_used[c] / 1048576.0, line_mem_peak[c] / 1048576.0, line_mem_huge[c] / 1048576.0);
+        used += line_mem_used[c];
+        huge += line_mem_huge[c];
+    }
+    printf("\t%-10s %10.2f MB (huge pages %.2f MB)\n", "total", used / 1048576.0, huge / 1048576.0);
+}
+
+// one cache line per node, so that the threads of different nodes do not share one
+struct line_numa_stat
+{
+    long long samples;
+    int cpus;
+    char pad[52];
+};
+
+static int line_numa_cnt = 0, line_numa_threads = 0;
+static int line_numa_id[LINE_NUMA_MAX];
+static cpu_set_t line_numa_cpus[LINE_NUMA_MAX];
+static line_numa_stat line_numa_stats[LINE_NUMA_MAX];
+
+int line_numa_init()
+{
+    char file_name[MAX_STRING], list[MAX_STRING * 4];
+    line_numa_cnt = 0;
+    for (int n = 0; n != LINE_NUMA_MAX; n++)
+    {
+        sprintf(file_name, "/sys/devices/system/node/node%d/cpulist", n);
+        FILE *fi = fopen(file_name, "rb");
+        if (fi == NULL) continue;
+        if (fgets(list, sizeof(list), fi) == NULL) list[0] = 0;
+        fclose(fi);
+        
+        // a list such as "0-11,24-35"
+        cpu_set_t set;
+        CPU_ZERO(&set);
+        char *p = list;
+        while (*p >= '0' && *p <= '9')
+        {
+            int a = (int)strtol(p, &p, 10), b = a;
+            if (*p == '-') b = (int)strtol(p + 1, &p, 10);
+            for (int c = a; c <= b && c < CPU_SETSIZE; c++) CPU_SET(c, &set);
+            if (*p == ',') p++;
+        }
+        if (CPU_COUNT(&set) == 0) continue;
+        line_numa_id[line_numa_cnt] = n;
+        line_numa_cpus[line_numa_cnt] = set;
+        line_numa_cnt++;
+    }
+    if (line_numa_cnt == 0)
+    {
+        line_numa_id[0] = 0;
+        CPU_ZERO(&line_numa_cpus[0]);
+        sched_getaffinity(0, sizeof(cpu_set_t), &line_numa_cpus[0]);
+        line_numa_cnt = 1;
+    }
+    
+    memset(line_numa_stats, 0, sizeof(line_numa_stats));
+    printf("NUMA nodes: %d\n", line_numa_cnt);
+    for (int k = 0; k != line_numa_cnt; k++)
+    {
+        line_numa_stats[k].cpus = CPU_COUNT(&line_numa_cpus[k]);
+        printf("\tnode %d: %d cpus\n", line_numa_id[k], line_numa_stats[k].cpus);
+    }
+    return line_numa_cnt;
+}
+
+int line_numa_nodes()
+{
+    return line_numa_cnt;
+}
+
+int line_numa_bind(int id, int num_threads)
+{
+    if (line_numa_cnt == 0) return 0;
+    int k = (int)((long long)id * line_numa_cnt / num_threads);
+    if (pthread_setaffinity_np(pthread_self(), sizeof(cpu_set_t), &line_numa_cpus[k]) != 0)
+        printf("WARNING: cannot bind thread %d to NUMA node %d\n", id, line_numa_id[k]);
+    line_numa_threads = num_threads;
+    return k;
+}
+
+void line_numa_count(int node, long long samples)
+{
+    __sync_add_and_fetch(&line_numa_stats[node].samples, samples);
+}
+
+void line_numa_report(double seconds)
+{
+    if (line_numa_cnt == 0) return;
+    if (seconds <= 0) seconds = 1e-9;
+    printf("Throughput per NUMA node:\n");
+    for (int k = 0; k != line_numa_cnt; k++)
+    {
+        line_numa_stat *st = &line_numa_stats[k];
+        int threads = 0;
+        for (int id = 0; id != line_numa_threads; id++) if ((long long)id * line_numa_cnt / line_numa_threads == k) threads++;
+        printf("\tnode %d: %d threads, %lld samples, %.0f samples/s", line_numa_id[k], threads, st->samples, st->samples / seconds);
+        if (threads > 0) printf(" (%.0f per thread)", st->samples / seconds / threads);
+        printf("\n");
+    }
+}
+
+// gradient of one coordinate, x being twice the difference
+template <int DIS> static inline real line_kernel_grad(real x)
+{
+    if (DIS == 1) return x > 0 ? 1 : -1;
+    if (DIS == 2) return x;
+    return 0;
+}
+
+// errors of the triple (h, t) and of its corruption (nh, nt) for line_triple::train_ht,
+// the rows being divided by their norms (given inverted)
+template <int DIS, int D> static void line_kernel_ht(int d, real lr, const real *h, const real *t, const real *r, const real *nh, const real *nt, real ih, real it, real inh, real int_, real *err)
+{
+    const int n = D > 0 ? D : d;
+    real *err_h = err, *err_t = err + n, *err_nh = err + 2 * n, *err_nt = err + 3 * n;
+    for (int c = 0; c < n; c++)
+    {
+        real x = line_kernel_grad<DIS>(2 * (t[c] * it - h[c] * ih - r[c]));
+        err_h[c] = lr * x;
+        err_t[c] = -lr * x;
+        x = line_kernel_grad<DIS>(2 * (nt[c] * int_ - nh[c] * inh - r[c]));
+        err_nh[c] = -lr * x;
+        err_nt[c] = lr * x;
+    }
+}
+
+// distances of u to v and to n
+template <int DIS, int D> static void line_kernel_dist(int d, const real *u, const real *v, const real *n, real *dpos, real *dneg)
+{
+    const int m = D > 0 ? D : d;
+    real sp = 0, sn = 0;
+    for (int c = 0; c < m; c++)
+    {
+        real x = u[c] - v[c], y = u[c] - n[c];
+        if (DIS == 1) {sp += fabs(x); sn += fabs(y);}
+        if (DIS == 2) {sp += x * x; sn += y * y;}
+    }
+    *dpos = sp;
+    *dneg = sn;
+}
+
+// pull v towards u and push n away, collecting the error of u in err (line_trainer_norm)
+template <int DIS, int D> static void line_kernel_margin(int d, real lr, const real *u, real *v, real *n, real *err)
+{
+    const int m = D > 0 ? D : d;
+    for (int c = 0; c < m; c++)
+    {
+        real x = line_kernel_grad<DIS>(2 * (u[c] - v[c]));
+        v[c] += lr * x;
+        err[c] = -lr * x;
+        x = line_kernel_grad<DIS>(2 * (u[c] - n[c]));
+        n[c] -= lr * x;
+        err[c] += lr * x;
+    }
+}
+
+// pull u and v together (line_regularizer_norm::train_uv)
+template <int DIS, int D> static void line_kernel_pair(int d, real lr, real *u, real *v)
+{
+    const int m = D > 0 ? D : d;
+    for (int c = 0; c < m; c++)
+    {
+        real x = line_kernel_grad<DIS>(2 * (u[c] - v[c]));
+        u[c] -= lr * x;
+        v[c] += lr * x;
+    }
+}
+
+// pull v towards u and push n away from it (line_regularizer_norm::train_uv_neg)
+template <int DIS, int D> static void line_kernel_pair_neg(int d, real lr, real *u, real *v, real *n)
+{
+    const int m = D > 0 ? D : d;
+    for (int c = 0; c < m; c++)
+    {
+        real x = line_kernel_grad<DIS>(2 * (v[c] - u[c]));
+        v[c] -= lr * x;
+        real y = line_kernel_grad<DIS>(2 * (n[c] - u[c]));
+        n[c] += lr * y;
+        u[c] += lr * (x - y);
+    }
+}
+
+struct line_kernel_set
+{
+    void (*ht)(int d, real lr, const real *h, const real *t, const real *r, const real *nh, const real *nt, real ih, real it, real inh, real int_, real *err);
+    void (*dist)(int d, const real *u, const real *v, const real *n, real *dpos, real *dneg);
+    void (*margin)(int d, real lr, const real *u, real *v, real *n, real *err);
+    void (*pair)(int d, real lr, real *u, real *v);
+    void (*pair_neg)(int d, real lr, real *u, real *v, real *n);
+};
+
+#define LINE_KERNEL_SET(DIS, D) {line_kernel_ht<DIS, D>, line_kernel_dist<DIS, D>, line_kernel_margin<DIS, D>, line_kernel_pair<DIS, D>, line_kernel_pair_neg<DIS, D>}
+#define LINE_KERNEL_DIMS(DIS) {LINE_KERNEL_SET(DIS, 0), LINE_KERNEL_SET(DIS, 50), LINE_KERNEL_SET(DIS, 100), LINE_KERNEL_SET(DIS, 128), LINE_KERNEL_SET(DIS, 200), LINE_KERNEL_SET(DIS, 256)}
+
+static const int line_kernel_dims[6] = {0, 50, 100, 128, 200, 256};
+static const line_kernel_set line_kernel_table[3][6] = {LINE_KERNEL_DIMS(0), LINE_KERNEL_DIMS(1), LINE_KERNEL_DIMS(2)};
+
+const line_kernel_set *line_kernel_select(int dis_type, int vector_size)
+{
+    int k = 5;
+    while (k > 0 && line_kernel_dims[k] != vector_size) k--;
+    return &line_kernel_table[dis_type == 1 || dis_type == 2 ? dis_type : 0][k];
+}
+
+static long long line_prefetch_samples[LINE_PREFETCH_KERNELS], line_prefetch_cycles[LINE_PREFETCH_KERNELS], line_prefetch_issued[LINE_PREFETCH_KERNELS];
+static int line_prefetch_distance = 0;
+static const char *line_prefetch_name[LINE_PREFETCH_KERNELS] = {"line", "reg-line", "triple"};
+
+line_prefetch::line_prefetch()
+{
+    distance = 0;
+    head = 0;
+    size = 0;
+    memset(samples, 0, sizeof(samples));
+    memset(cycles, 0, sizeof(cycles));
+    memset(issued, 0, sizeof(issued));
+}
+
+void line_prefetch::init(int p_distance)
+{
+    distance = std::max(0, std::min(p_distance, LINE_PREFETCH_MAX));
+    head = 0;
+    size = 0;
+    line_prefetch_distance = distance;
+}
+
+void line_prefetch::merge()
+{
+    for (int k = 0; k != LINE_PREFETCH_KERNELS; k++)
+    {
+        __sync_add_and_fetch(&line_prefetch_samples[k], samples[k]);
+        __sync_add_and_fetch(&line_prefetch_cycles[k], cycles[k]);
+        __sync_add_and_fetch(&line_prefetch_issued[k], issued[k]);
+        samples[k] = 0;
+        cycles[k] = 0;
+        issued[k] = 0;
+    }
+}
+
+void line_prefetch_report()
+{
+    printf("Prefetch distance %d:\n", line_prefetch_distance);
+    for (int k = 0; k != LINE_PREFETCH_KERNELS; k++)
+    {
+        if (line_prefetch_samples[k] == 0) continue;
+        printf("\t%-10s %lld samples, %.0f cycles/sample, %lld prefetches issued\n", line_prefetch_name[k], line_prefetch_samples[k], (double)line_prefetch_cycles[k] / line_prefetch_samples[k], line_prefetch_issued[k]);
+    }
+}
+
+line_rng::line_rng()
+{
+    seed(0);
+}
+
+void line_rng::seed(unsigned long long sd)
+{
+    // expand the seed with splitmix64 so that nearby seeds give unrelated streams
+    unsigned long long z;
+    z = (sd += 0x9E3779B97F4A7C15ULL);
+    z = (z ^ (z >> 30)) * 0xBF58476D1CE4E5B9ULL;
+    z = (z ^ (z >> 27)) * 0x94D049BB133111EBULL;
+    s0 = z ^ (z >> 31);
+    z = (sd += 0x9E3779B97F4A7C15ULL);
+    z = (z ^ (z >> 30)) * 0xBF58476D1CE4E5B9ULL;
+    z = (z ^ (z >> 27)) * 0x94D049BB133111EBULL;
+    s1 = z ^ (z >> 31);
+    if (s0 == 0 && s1 == 0) s1 = 1;
+}
+
+line_vocab::line_vocab()
+{
+    names = NULL;
+    names_size = 0;
+    names_max_size = 0;
+    name_pst = NULL;
+    vocab_size = 0;
+    vocab_max_size = 0;
+    vocab_hash = NULL;
+    hash_size = 0;
+}
+
+line_vocab::~line_vocab()
+{
+    if (names != NULL) {free(names); names = NULL;}
+    names_size = 0;
+    names_max_size = 0;
+    if (name_pst != NULL) {free(name_pst); name_pst = NULL;}
+    vocab_size = 0;
+    vocab_max_size = 0;
+    if (vocab_hash != NULL) {free(vocab_hash); vocab_hash = NULL;}
+    hash_size = 0;
+}
+
+// FNV-1a followed by a 64-bit finalizer
+unsigned long long line_vocab::get_hash(const char *word)
+{
+    unsigned long long hash = 14695981039346656037ULL;
+    for (const unsigned char *p = (const unsigned char *)word; *p; p++)
+    {
+        hash ^= *p;
+        hash *= 1099511628211ULL;
+    }
+    hash ^= hash >> 33;
+    hash *= 0xFF51AFD7ED558CCDULL;
+    hash ^= hash >> 33;
+    return hash;
+}
+
+void line_vocab::rehash(long long new_hash_size)
+{
+    if (vocab_hash != NULL) free(vocab_hash);
+    hash_size = new_hash_size;
+    vocab_hash = (int *)malloc(hash_size * sizeof(int));
+    if (vocab_hash == NULL) { printf("Memory allocation failed\n"); exit(1); }
+    for (long long k = 0; k != hash_size; k++) vocab_hash[k] = -1;
+    for (int id = 0; id != vocab_size; id++)
+    {
+        long long hash = get_hash(get_name(id)) & (hash_size - 1);
+        while (vocab_hash[hash] != -1) hash = (hash + 1) & (hash_size - 1);
+        vocab_hash[hash] = id;
+    }
+}
+
+int line_vocab::search(const char *word)
+{
+    if (vocab_size == 0) return -1;
+    long long hash = get_hash(word) & (hash_size - 1);
+    while (1) {
+        if (vocab_hash[hash] == -1) return -1;
+        if (!strcmp(word, get_name(vocab_hash[hash]))) return vocab_hash[hash];
+        hash = (hash + 1) & (hash_size - 1);
+    }
+    return -1;
+}
+
+int line_vocab::add(const char *word)
+{
+    long long length = strlen(word) + 1;
+    
+    // Reallocate memory if needed
+    if (names_size + length > names_max_size)
+    {
+        while (names_size + length > names_max_size) names_max_size = names_max_size * 2 + MAX_STRING;
+        names = (char *)realloc(names, names_max_size * sizeof(char));
+        if (names == NULL) { printf("Memory allocation failed\n"); exit(1); }
+    }
+    if (vocab_size == vocab_max_size)
+    {
+        vocab_max_size = vocab_max_size * 2 + 1000;
+        name_pst = (long long *)realloc(name_pst, vocab_max_size * sizeof(long long));
+        if (name_pst == NULL) { printf("Memory allocation failed\n"); exit(1); }
+    }
+    // keep the hash table at most half full
+    if ((long long)(vocab_size + 1) * 2 > hash_size) rehash(hash_size == 0 ? 1024 : hash_size * 2);
+    
+    memcpy(names + names_size, word, length);
+    name_pst[vocab_size] = names_size;
+    names_size += length;
+    vocab_size++;
+    
+    long long hash = get_hash(word) & (hash_size - 1);
+    while (vocab_hash[hash] != -1) hash = (hash + 1) & (hash_size - 1);
+    vocab_hash[hash] = vocab_size - 1;
+    return vocab_size - 1;
+}
+
+void line_vocab::init(const char *file_name)
+{
+    FILE *fi = fopen(file_name, "rb");
+    if (fi == NULL)
+    {
+        printf("ERROR: node file not found!\n");
+        printf("%s\n", file_name);
+        exit(1);
+    }
+    
+    // size the arena from the file so that it is filled without regrowing
+    fseek(fi, 0, SEEK_END);
+    names_max_size = ftell(fi) + 1;
+    fseek(fi, 0, SEEK_SET);
+    names = (char *)malloc(names_max_size * sizeof(char));
+    if (names == NULL) { printf("Memory allocation failed\n"); exit(1); }
+    
+    char word[MAX_STRING];
+    while (1)
+    {
+        if (fscanf(fi, "%s", word) != 1) break;
+        add(word);
+    }
+    fclose(fi);
+}
+
+unsigned long long line_vocab::get_signature()
+{
+    unsigned long long sig = 14695981039346656037ULL ^ (unsigned long long)vocab_size;
+    for (long long k = 0; k != names_size; k++)
+    {
+        sig ^= (unsigned char)names[k];
+        sig *= 1099511628211ULL;
+    }
+    return sig;
+}
+
 line_node::line_node() : vec(NULL, 0, 0)
 {
-    node = NULL;
-    node_size = 0;
-    node_max_size = 1000;
-    vector_size = 0;
-    node_file[0] = 0;
-    node_hash = NULL;
-    _vec = NULL;
+    vocab = NULL;
+    vocab_owner = false;
+    node_size = 0;
+    vector_size = 0;
+    node_file[0] = 0;
+    storage = LINE_STORAGE_FP32;
+    _vec = NULL;
+    _hvec = NULL;
+    _norm = NULL;
+    order = NULL;
+    warm = NULL;
+    table_fd = -1;
+    table_bytes = 0;
+    filled = NULL;
+}
+
+line_node::~line_node()
+{
+    if (vocab != NULL && vocab_owner) delete vocab;
+    vocab = NULL;
+    vocab_owner = false;
+    node_size = 0;
+    vector_size = 0;
+    node_file[0] = 0;
+    if (table_fd != -1)
+    {
+        munmap(storage == LINE_STORAGE_BF16 ? (void *)_hvec : (void *)_vec, table_bytes);
+        close(table_fd);
+        table_fd = -1;
+        _vec = NULL;
+        _hvec = NULL;
+    }
+    if (_vec != NULL) {line_mem_free(_vec); _vec = NULL;}
+    if (_hvec != NULL) {line_mem_free(_hvec); _hvec = NULL;}
+    if (_norm != NULL) {line_mem_free(_norm); _norm = NULL;}
+    if (order != NULL) {line_mem_free(order); order = NULL;}
+    if (filled != NULL) {free(filled); filled = NULL;}
+    if (warm != NULL) {line_mem_free(warm); warm = NULL;}
+    new (&vec) Eigen::Map<BLPMatrix>(NULL, 0, 0);
+}
+
+int line_node::search(const char *word)
+{
+    int id = vocab->search(word);
+    if (id == -1 || order == NULL) return id;
+    return order[id];
+}
+
+void line_node::init(const char *file_name, int vector_dim, int storage_type, const char *warm_file, int warm_binary, const char *table_file)
+{
+    strcpy(node_file, file_name);
+    vector_size = vector_dim;
+    storage = storage_type;
+    
+    vocab = new line_vocab;
+    vocab_owner = true;
+    vocab->init(node_file);
+    node_size = vocab->size();
+    
+    init_vec(table_file);
+    
+    printf("Reading nodes from file: %s, DONE!\n", node_file);
+    printf("Node size: %d\n", node_size);
+    printf("Node dims: %d\n", vector_size);
+    if (storage == LINE_STORAGE_BF16) printf("Node storage: bf16\n");
+    
+    if (warm_file != NULL) load_warm(warm_file, warm_binary);
+}
+
+void line_node::init(line_node *p_node, int vector_dim, int storage_type, const char *warm_file, int warm_binary, const char *table_file)
+{
+    strcpy(node_file, p_node->node_file);
+    vector_size = vector_dim;
+    storage = storage_type;
+    
+    vocab = p_node->vocab;
+    vocab_owner = false;
+    node_size = vocab->size();
+    
+    init_vec(table_file);
+    
+    printf("Sharing nodes from file: %s, DONE!\n", node_file);
+    printf("Node size: %d\n", node_size);
+    printf("Node dims: %d\n", vector_size);
+    if (storage == LINE_STORAGE_BF16) printf("Node storage: bf16\n");
+    
+    if (warm_file != NULL) load_warm(warm_file, warm_binary);
+}
+
+void line_node::load_warm(const char *file_name, int binary)
+{
+    char name[MAX_STRING], magic[8];
+    int id;
+    long long n = 0, d = 0, cnt = 0;
+    real *buf = (real *)malloc(vector_size * sizeof(real));
+    unsigned short *hbuf = (unsigned short *)malloc(vector_size * sizeof(unsigned short));
+    
+    warm = (unsigned char *)line_mem_alloc(node_size, LINE_MEM_VECTOR);
+    
+    FILE *fi = fopen(file_name, "rb");
+    if (fi == NULL)
+    {
+        printf("ERROR: warm start file not found!\n");
+        printf("%s\n", file_name);
+        exit(1);
+    }
+    
+    if (fread(magic, 1, 8, fi) == 8 && memcmp(magic, "LINECKP", 8) == 0)
+    {
+        // a checkpoint: map it and look every name up
+        struct stat st;
+        if (fstat(fileno(fi), &st) != 0 || st.st_size < (long long)sizeof(line_checkpoint_header))
+        {
+            printf("ERROR: warm start checkpoint is truncated or corrupt!\n");
+            printf("%s\n", file_name);
+            exit(1);
+        }
+        long long size = st.st_size;
+        char *map = (char *)mmap(NULL, size, PROT_READ, MAP_PRIVATE, fileno(fi), 0);
+        if (map == MAP_FAILED)
+        {
+            printf("ERROR: cannot map warm start file!\n");
+            exit(1);
+        }
+        line_checkpoint_header *header = (line_checkpoint_header *)map;
+        if (header->version != LINE_CHECKPOINT_VERSION || header->vector_size != vector_size)
+        {
+            printf("ERROR: warm start file does not match the vector dimension!\n");
+            exit(1);
+        }
+        
+        // every block must lie inside the file: a checkpoint cut off while being
+        // copied would otherwise be read past the end of the mapping
+        n = header->node_size;
+        long long row_size = vector_size * (header->storage == LINE_STORAGE_BF16 ? sizeof(unsigned short) : sizeof(real));
+        long long name_size = header->name_size;
+        if ((header->storage != LINE_STORAGE_FP32 && header->storage != LINE_STORAGE_BF16)
+            || n < 0 || n >= size / (long long)sizeof(long long)
+            || header->pst_offset < (long long)sizeof(line_checkpoint_header) || header->pst_offset > size
+            || (n + 1) * (long long)sizeof(long long) > size - header->pst_offset
+            || header->name_offset < 0 || header->name_offset > size || name_size < 0 || name_size > size - header->name_offset
+            || header->vec_offset < 0 || header->vec_offset > size || n * row_size > size - header->vec_offset)
+        {
+            printf("ERROR: warm start checkpoint is truncated or corrupt!\n");
+            printf("%s\n", file_name);
+            exit(1);
+        }
+        long long *pst = (long long *)(map + header->pst_offset);
+        char *names = map + header->name_offset;
+        for (long long a = 0; a != n; a++)
+        {
+            // name a spans [pst[a], pst[a + 1]) including its '\0'
+            if (pst[a] < 0 || pst[a] >= pst[a + 1] || pst[a + 1] > name_size || names[pst[a + 1] - 1] != 0)
+            {
+                printf("ERROR: warm start checkpoint is truncated or corrupt!\n");
+                printf("%s\n", file_name);
+                exit(1);
+            }
+            id = search(names + pst[a]);
+            if (id == -1) continue;
+            if (header->storage == LINE_STORAGE_BF16)
+            {
+                unsigned short *src = (unsigned short *)(map + header->vec_offset) + a * vector_size;
+                for (int c = 0; c != vector_size; c++) buf[c] = line_bf16_to_real(src[c]);
+            }
+            else memcpy(buf, (real *)(map + header->vec_offset) + a * vector_size, vector_size * sizeof(real));
+            put_row(id, buf);
+            warm[id] = 1;
+            if (filled != NULL) filled[id] = 1;
+            cnt++;
+        }
+        munmap(map, size);
+    }
+    else
+    {
+        // a file written by output with the given binary mode: text, fp32 or, for
+        // mode 2 on a bf16 node, bf16 rows
+        rewind(fi);
+        if (fscanf(fi, "%lld %lld", &n, &d) != 2 || d != vector_size)
+        {
+            printf("ERROR: warm start file does not match the vector dimension!\n");
+            exit(1);
+        }
+        int mode = binary == 0 ? 0 : (binary == 2 && storage == LINE_STORAGE_BF16 ? 2 : 1);
+        
+        for (long long a = 0; a != n; a++)
+        {
+            if (fscanf(fi, "%s", name) != 1) break;
+            fgetc(fi);
+            int c = 0;
+            if (mode == 1) c = (int)fread(buf, sizeof(real), vector_size, fi);
+            else if (mode == 2)
+            {
+                c = (int)fread(hbuf, sizeof(unsigned short), vector_size, fi);
+                for (int k = 0; k != c; k++) buf[k] = line_bf16_to_real(hbuf[k]);
+            }
+            else while (c != vector_size && fscanf(fi, "%f", &buf[c]) == 1) c++;
+            
+            // a short row, or a binary row not followed by its '\n', means the file is not in this mode
+            if (c != vector_size || (mode != 0 && fgetc(fi) != '\n'))
+            {
+                printf("ERROR: warm start file is not in -binary %d format or is truncated at row %lld!\n", binary, a);
+                printf("%s\n", file_name);
+                exit(1);
+            }
+            
+            id = search(name);
+            if (id == -1) continue;
+            put_row(id, buf);
+            warm[id] = 1;
+            if (filled != NULL) filled[id] = 1;
+            cnt++;
+        }
+    }
+    fclose(fi);
+    free(buf);
+    free(hbuf);
+    
+    printf("Warm start from file: %s, DONE!\n", file_name);
+    printf("Known nodes: %lld, new nodes: %lld\n", cnt, node_size - cnt);
+}
+
+void line_node::init_vec(const char *table_file)
+{
+    long long a, b;
+    if (table_file != NULL)
+    {
+        // the file starts sparse; its rows are written when fill_rows first needs them
+        table_bytes = (long long)node_size * vector_size * (storage == LINE_STORAGE_BF16 ? sizeof(unsigned short) : sizeof(real));
+        table_fd = open(table_file, O_RDWR | O_CREAT | O_TRUNC, 0644);
+        if (table_fd == -1 || ftruncate(table_fd, table_bytes) != 0)
+        {
+            printf("ERROR: cannot create table file!\n");
+            printf("%s\n", table_file);
+            exit(1);
+        }
+        void *map = table_bytes > 0 ? mmap(NULL, table_bytes, PROT_READ | PROT_WRITE, MAP_SHARED, table_fd, 0) : NULL;
+        if (map == MAP_FAILED)
+        {
+            printf("ERROR: cannot map table file!\n");
+            exit(1);
+        }
+        if (storage == LINE_STORAGE_BF16) _hvec = (unsigned short *)map;
+        else _vec = (real *)map;
+        if (storage != LINE_STORAGE_BF16) new (&vec) Eigen::Map<BLPMatrix>(_vec, node_size, vector_size);
+        filled = (unsigned char *)calloc(node_size > 0 ? node_size : 1, sizeof(unsigned char));
+        _norm = (real *)line_mem_alloc(node_size * sizeof(real), LINE_MEM_VECTOR);
+        return;
+    }
+    else if (storage == LINE_STORAGE_BF16)
+    {
+        _hvec = (unsigned short *)line_mem_alloc((long long)node_size * vector_size * sizeof(unsigned short), LINE_MEM_VECTOR);
+        for (b = 0; b < vector_size; b++) for (a = 0; a < node_size; a++)
+            _hvec[a * vector_size + b] = line_real_to_bf16((rand() / (real)RAND_MAX - 0.5) / vector_size);
+    }
+    else
+    {
+        _vec = (real *)line_mem_alloc((long long)node_size * vector_size * sizeof(real), LINE_MEM_VECTOR);
+        for (b = 0; b < vector_size; b++) for (a = 0; a < node_size; a++)
+            _vec[a * vector_size + b] = (rand() / (real)RAND_MAX - 0.5) / vector_size;
+        new (&vec) Eigen::Map<BLPMatrix>(_vec, node_size, vector_size);
+    }
+    
+    _norm = (real *)line_mem_alloc(node_size * sizeof(real), LINE_MEM_VECTOR);
+    update_norm();
+}
+
+void line_node::fill_rows(int begin, int end)
+{
+    if (filled == NULL) return;
+    real *buf = (real *)malloc(vector_size * sizeof(real));
+    line_rng rng;
+    for (int a = begin; a < end; a++)
+    {
+        if (filled[a]) continue;
+        // seeded by the row, so that a row does not depend on when its bucket is loaded
+        rng.seed(a);
+        for (int b = 0; b != vector_size; b++) buf[b] = (rng.rand_num() - 0.5) / vector_size;
+        put_row(a, buf);
+        filled[a] = 1;
+    }
+    free(buf);
+}
+
+void line_node::update_norm()
+{
+    for (int a = 0; a != node_size; a++) update_norm(a);
+}
+
+void line_node::reorder(int *new_id)
+{
+    if (table_fd != -1)
+    {
+        printf("ERROR: cannot reorder a table kept in a file!\n");
+        exit(1);
+    }
+    long long row_size = vector_size * (storage == LINE_STORAGE_BF16 ? sizeof(unsigned short) : sizeof(real));
+    char *src = storage == LINE_STORAGE_BF16 ? (char *)_hvec : (char *)_vec;
+    char *dst = (char *)line_mem_alloc(node_size * row_size, LINE_MEM_VECTOR);
+    real *norm = (real *)line_mem_alloc(node_size * sizeof(real), LINE_MEM_VECTOR);
+    int *new_order = (int *)line_mem_alloc(node_size * sizeof(int), LINE_MEM_VECTOR);
+    unsigned char *new_warm = warm == NULL ? NULL : (unsigned char *)line_mem_alloc(node_size, LINE_MEM_VECTOR);
+    
+    // rows are currently placed by order (or by vocabulary id)
+    for (int a = 0; a != node_size; a++)
+    {
+        int row = order == NULL ? a : order[a];
+        memcpy(dst + new_id[a] * row_size, src + row * row_size, row_size);
+        norm[new_id[a]] = _norm[row];
+        new_order[a] = new_id[a];
+        if (warm != NULL) new_warm[new_id[a]] = warm[row];
+    }
+    line_mem_free(src);
+    line_mem_free(_norm);
+    if (order != NULL) line_mem_free(order);
+    if (warm != NULL) line_mem_free(warm);
+    _norm = norm;
+    order = new_order;
+    warm = new_warm;
+    if (storage == LINE_STORAGE_BF16) _hvec = (unsigned short *)dst;
+    else
+    {
+        _vec = (real *)dst;
+        new (&vec) Eigen::Map<BLPMatrix>(_vec, node_size, vector_size);
+    }
+}
+
+unsigned long long line_node::get_signature()
+{
+    unsigned long long sig = vocab->get_signature();
+    if (order == NULL) return sig;
+    for (int a = 0; a != node_size; a++)
+    {
+        sig ^= (unsigned int)order[a];
+        sig *= 1099511628211ULL;
+    }
+    return sig;
+}
+
+void line_node::output(const char *file_name, int binary)
+{
+    FILE *fo = fopen(file_name, "wb");
+    real *buf = (real *)malloc(vector_size * sizeof(real));
+    fprintf(fo, "%d %d\n", node_size, vector_size);
+    for (int a = 0; a != node_size; a++)
+    {
+        int id = order == NULL ? a : order[a];
+        fprintf(fo, "%s ", vocab->get_name(a));
+        if (binary == 2 && storage == LINE_STORAGE_BF16) fwrite(_hvec + (long long)id * vector_size, sizeof(unsigned short), vector_size, fo);
+        else
+        {
+            real *row = get_row(id, buf);
+            if (binary) fwrite(row, sizeof(real), vector_size, fo);
+            else for (int b = 0; b != vector_size; b++) fprintf(fo, "%lf ", row[b]);
+        }
+        fprintf(fo, "\n");
+    }
+    free(buf);
+    fclose(fo);
+}
+
+static int line_load_threads = 1;
+
+void line_load_config(int num_threads)
+{
+    line_load_threads = num_threads > 0 ? num_threads : 1;
+}
+
+// One line-aligned piece of a text file and the ids parsed from it. Triples
+// use id[0..2] for head, tail and relation; edges use id[0..1], wei and tp.
+struct line_load_part
+{
+    const char *begin, *end;
+    line_node *node[3];
+    bool typed;
+    std::vector<int> id[3];
+    std::vector<float> wei;
+    std::vector<unsigned char> tp;
+};
+
+// Copy the next whitespace-separated token of the current line into word;
+// false if the line has no token left.
+static bool line_next_token(const char *&p, const char *end, char *word)
+{
+    while (p != end && (*p == ' ' || *p == '\t' || *p == '\r')) p++;
+    if (p == end || *p == '\n') return false;
+    int len = 0;
+    while (p != end && *p != ' ' && *p != '\t' && *p != '\r' && *p != '\n')
+    {
+        if (len < MAX_STRING - 1) word[len++] = *p;
+        p++;
+    }
+    word[len] = 0;
+    return true;
+}
+
+static void line_next_line(const char *&p, const char *end)
+{
+    while (p != end && *p != '\n') p++;
+    if (p != end) p++;
+}
+
+static void *line_load_triple_part(void *p_part)
+{
+    line_load_part *part = (line_load_part *)p_part;
+    char sh[MAX_STRING], st[MAX_STRING], sr[MAX_STRING];
+    int h, t, r;
+    const char *p = part->begin;
+    while (p != part->end)
+    {
+        if (line_next_token(p, part->end, sh) && line_next_token(p, part->end, st) && line_next_token(p, part->end, sr))
+        {
+            h = part->node[0]->search(sh);
+            t = part->node[1]->search(st);
+            r = part->node[2]->search(sr);
+            if (h != -1 && t != -1 && r != -1)
+            {
+                part->id[0].push_back(h);
+                part->id[1].push_back(t);
+                part->id[2].push_back(r);
+            }
+        }
+        line_next_line(p, part->end);
+    }
+    return NULL;
+}
+
+static void *line_load_hin_part(void *p_part)
+{
+    line_load_part *part = (line_load_part *)p_part;
+    char word1[MAX_STRING], word2[MAX_STRING], sw[MAX_STRING], stp[MAX_STRING];
+    int u, v;
+    const char *p = part->begin;
+    while (p != part->end)
+    {
+        if (line_next_token(p, part->end, word1) && line_next_token(p, part->end, word2) && line_next_token(p, part->end, sw) && (!part->typed || line_next_token(p, part->end, stp)))
+        {
+            u = part->node[0]->search(word1);
+            v = part->node[1]->search(word2);
+            if (u != -1 && v != -1)
+            {
+                part->id[0].push_back(u);
+                part->id[1].push_back(v);
+                part->wei.push_back(atof(sw));
+                part->tp.push_back(part->typed ? stp[0] : 0);
+            }
+        }
+        line_next_line(p, part->end);
+    }
+    return NULL;
+}
+
+// Map the file, cut it at line boundaries into one piece per part and run
+// parse on every piece on its own thread. Only the vocabularies are shared,
+// and they are only read.
+static void line_load_file(const char *file_name, const char *what, std::vector<line_load_part> &part, void *(*parse)(void *))
+{
+    int fd = open(file_name, O_RDONLY);
+    struct stat st;
+    if (fd == -1 || fstat(fd, &st) != 0)
+    {
+        printf("ERROR: %s file not found!\n", what);
+        printf("%s\n", file_name);
+        exit(1);
+    }
+    long long size = st.st_size;
+    const char *map = NULL;
+    if (size > 0)
+    {
+        map = (const char *)mmap(NULL, size, PROT_READ, MAP_PRIVATE, fd, 0);
+        if (map == MAP_FAILED)
+        {
+            printf("ERROR: cannot map %s file!\n", what);
+            exit(1);
+        }
+        madvise((void *)map, size, MADV_SEQUENTIAL);
+    }
+    close(fd);
+    
+    int parts = part.size();
+    const char *p = map;
+    for (int k = 0; k != parts; k++)
+    {
+        const char *end = map + size * (k + 1) / parts;
+        if (end < p) end = p;
+        while (end != map + size && end != map && end[-1] != '\n') end++;
+        part[k].begin = p;
+        part[k].end = end;
+        p = end;
+    }
+    
+    pthread_t *pt = (pthread_t *)malloc(parts * sizeof(pthread_t));
+    for (int k = 1; k < parts; k++) pthread_create(&pt[k], NULL, parse, (void *)&part[k]);
+    parse((void *)&part[0]);
+    for (int k = 1; k < parts; k++) pthread_join(pt[k], NULL);
+    free(pt);
+    
+    if (map != NULL) munmap((void *)map, size);
+}
+
+static long long line_page_align(long long size)
+{
+    return (size + 4095) / 4096 * 4096;
+}
+
+static void line_checkpoint_write(FILE *fo, const void *data, long long size, const char *file_name)
+{
+    if (size > 0 && (long long)fwrite(data, 1, size, fo) != size)
+    {
+        printf("ERROR: checkpoint write failed!\n");
+        printf("%s\n", file_name);
+        exit(1);
+    }
+}
+
+void line_node::save_checkpoint(const char *file_name, long long step)
+{
+    char tmp_file[MAX_STRING + 8];
+    sprintf(tmp_file, "%s.tmp", file_name);
+    FILE *fo = fopen(tmp_file, "wb");
+    if (fo == NULL)
+    {
+        printf("ERROR: cannot write checkpoint file!\n");
+        printf("%s\n", tmp_file);
+        exit(1);
+    }
+    
+    long long *name_pst = (long long *)malloc((node_size + 1) * sizeof(long long));
+    name_pst[0] = 0;
+    for (int a = 0; a != node_size; a++) name_pst[a + 1] = name_pst[a] + strlen(vocab->get_name(a)) + 1;
+    
+    line_checkpoint_header header;
+    memset(&header, 0, sizeof(header));
+    memcpy(header.magic, "LINECKP", 8);
+    header.version = LINE_CHECKPOINT_VERSION;
+    header.storage = storage;
+    header.node_size = node_size;
+    header.vector_size = vector_size;
+    header.step = step;
+    header.pst_offset = line_page_align(sizeof(header));
+    header.name_offset = line_page_align(header.pst_offset + (node_size + 1) * sizeof(long long));
+    header.name_size = name_pst[node_size];
+    header.vec_offset = line_page_align(header.name_offset + header.name_size);
+    
+    // everything but the rows is small, so it is written through one zeroed page
+    char *page = (char *)calloc(4096, 1);
+    line_checkpoint_write(fo, &header, sizeof(header), file_name);
+    line_checkpoint_write(fo, page, header.pst_offset - sizeof(header), file_name);
+    line_checkpoint_write(fo, name_pst, (node_size + 1) * sizeof(long long), file_name);
+    line_checkpoint_write(fo, page, header.name_offset - header.pst_offset - (node_size + 1) * sizeof(long long), file_name);
+    for (int a = 0; a != node_size; a++) line_checkpoint_write(fo, vocab->get_name(a), name_pst[a + 1] - name_pst[a], file_name);
+    line_checkpoint_write(fo, page, header.vec_offset - header.name_offset - header.name_size, file_name);
+    
+    // rows are gathered into vocabulary order through a 1 MB buffer
+    long long row_size = vector_size * (storage == LINE_STORAGE_BF16 ? sizeof(unsigned short) : sizeof(real));
+    char *src = storage == LINE_STORAGE_BF16 ? (char *)_hvec : (char *)_vec;
+    long long buf_rows = (1 << 20) / row_size + 1, cnt = 0;
+    char *buf = (char *)malloc(buf_rows * row_size);
+    for (int a = 0; a != node_size; a++)
+    {
+        int row = order == NULL ? a : order[a];
+        memcpy(buf + cnt * row_size, src + row * row_size, row_size);
+        if (++cnt == buf_rows)
+        {
+            line_checkpoint_write(fo, buf, cnt * row_size, file_name);
+            cnt = 0;
+        }
+    }
+    line_checkpoint_write(fo, buf, cnt * row_size, file_name);
+    free(buf);
+    free(page);
+    free(name_pst);
+    
+    if (fclose(fo) != 0 || rename(tmp_file, file_name) != 0)
+    {
+        printf("ERROR: cannot write checkpoint file!\n");
+        printf("%s\n", file_name);
+        exit(1);
+    }
 }
 
-line_node::~line_node()
+line_checkpoint::line_checkpoint()
 {
-    if (node != NULL) {free(node); node = NULL;}
-    node_size = 0;
-    node_max_size = 0;
-    vector_size = 0;
-    node_file[0] = 0;
-    if (node_hash != NULL) {free(node_hash); node_hash = NULL;}
-    if (_vec != NULL) {free(_vec); _vec = NULL;}
-    new (&vec) Eigen::Map<BLPMatrix>(NULL, 0, 0);
+    node_cnt = 0;
+    step = 0;
+    started = false;
+    busy = 0;
 }
 
-int line_node::get_hash(char *word)
+line_checkpoint::~line_checkpoint()
 {
-    unsigned long long a, hash = 0;
-    for (a = 0; a < strlen(word); a++) hash = hash * 257 + word[a];
-    hash = hash % hash_table_size;
-    return hash;
+    wait();
+    node_cnt = 0;
 }
 
-int line_node::search(char *word)
+void line_checkpoint::add(line_node *p_node, const char *file_name)
 {
-    unsigned int hash = get_hash(word);
-    while (1) {
-        if (node_hash[hash] == -1) return -1;
-        if (!strcmp(word, node[node_hash[hash]].word)) return node_hash[hash];
-        hash = (hash + 1) % hash_table_size;
+    if (node_cnt == LINE_CHECKPOINT_MAX)
+    {
+        printf("ERROR: too many nodes to checkpoint!\n");
+        exit(1);
     }
-    return -1;
+    node[node_cnt] = p_node;
+    strcpy(file[node_cnt], file_name);
+    node_cnt++;
 }
 
-int line_node::add_node(char *word)
+void *line_checkpoint::write_thread(void *p_checkpoint)
 {
-    unsigned int hash, length = strlen(word) + 1;
-    if (length > MAX_STRING) length = MAX_STRING;
-    node[node_size].word = (char *)calloc(length, sizeof(char));
-    strcpy(node[node_size].word, word);
-    node_size++;
-    // Reallocate memory if needed
-    if (node_size + 2 >= node_max_size) {
-        node_max_size += 1000;
-        node = (struct struct_node *)realloc(node, node_max_size * sizeof(struct struct_node));
+    line_checkpoint *ckpt = (line_checkpoint *)p_checkpoint;
+    for (int k = 0; k != ckpt->node_cnt; k++) ckpt->node[k]->save_checkpoint(ckpt->file[k], ckpt->step);
+    __sync_synchronize();
+    ckpt->busy = 0;
+    return NULL;
+}
+
+bool line_checkpoint::start(long long cur_step)
+{
+    if (busy) return false;
+    if (started) pthread_join(thread, NULL);
+    step = cur_step;
+    busy = 1;
+    started = true;
+    if (pthread_create(&thread, NULL, write_thread, (void *)this) != 0)
+    {
+        printf("ERROR: cannot start checkpoint thread!\n");
+        exit(1);
     }
-    hash = get_hash(word);
-    while (node_hash[hash] != -1) hash = (hash + 1) % hash_table_size;
-    node_hash[hash] = node_size - 1;
-    return node_size - 1;
+    return true;
 }
 
-void line_node::init(const char *file_name, int vector_dim)
+void line_checkpoint::wait()
 {
-    strcpy(node_file, file_name);
-    vector_size = vector_dim;
+    if (!started) return;
+    pthread_join(thread, NULL);
+    started = false;
+    busy = 0;
+}
+
+line_scheduler::line_scheduler()
+{
+    total = 0;
+    epochs = 0;
+    num_threads = 0;
+    starting_alpha = 0;
+    counter = NULL;
+    alpha = 0;
+    done = 0;
+    running = 0;
+    hook = NULL;
+    started = false;
+}
+
+line_scheduler::~line_scheduler()
+{
+    if (started) stop();
+    if (counter != NULL) {free(counter); counter = NULL;}
+}
+
+void line_scheduler::init(long long p_total, real p_alpha, int p_num_threads, long long p_epochs)
+{
+    total = p_total;
+    starting_alpha = p_alpha;
+    num_threads = p_num_threads;
+    epochs = p_epochs;
+    alpha = starting_alpha;
+    done = 0;
+    
+    if (counter != NULL) free(counter);
+    if (posix_memalign((void **)&counter, 64, num_threads * sizeof(line_scheduler_counter)) != 0)
+    {
+        printf("ERROR: cannot allocate the scheduler counters!\n");
+        exit(1);
+    }
+    memset(counter, 0, num_threads * sizeof(line_scheduler_counter));
+}
+
+long long line_scheduler::get_budget(int id)
+{
+    return total / num_threads + (id < total % num_threads ? 1 : 0);
+}
+
+void line_scheduler::tick(bool report)
+{
+    long long sum = 0;
+    for (int k = 0; k != num_threads; k++) sum += __atomic_load_n(&counter[k].samples, __ATOMIC_ACQUIRE);
+    done = sum;
     
-    node = (struct struct_node *)calloc(node_max_size, sizeof(struct struct_node));
-    node_hash = (int *)calloc(hash_table_size, sizeof(int));
-    for (int k = 0; k != hash_table_size; k++) node_hash[k] = -1;
+    real cur_alpha = starting_alpha * (1 - sum / (real)(total + 1));
+    if (cur_alpha < starting_alpha * 0.0001) cur_alpha = starting_alpha * 0.0001;
+    alpha = cur_alpha;
     
-    FILE *fi = fopen(node_file, "rb");
-    if (fi == NULL)
+    if (report)
     {
-        printf("ERROR: node file not found!\n");
-        printf("%s\n", node_file);
+        if (epochs > 0) printf("%cAlpha: %f Epoch: %.3lf/%lld", 13, cur_alpha, (real)sum / (real)total * epochs, epochs);
+        else printf("%cAlpha: %f Progress: %.3lf%%", 13, cur_alpha, (real)sum / (real)(total + 1) * 100);
+        fflush(stdout);
+    }
+    if (hook != NULL) hook(sum);
+}
+
+void *line_scheduler::monitor_thread(void *p_scheduler)
+{
+    line_scheduler *sched = (line_scheduler *)p_scheduler;
+    for (int k = 1; sched->running; k++)
+    {
+        usleep(LINE_SCHEDULER_TICK * 1000);
+        sched->tick(k % LINE_SCHEDULER_REPORT == 0);
+    }
+    return NULL;
+}
+
+void line_scheduler::start(void (*p_hook)(long long cur_step))
+{
+    hook = p_hook;
+    running = 1;
+    started = true;
+    if (pthread_create(&thread, NULL, monitor_thread, (void *)this) != 0)
+    {
+        printf("ERROR: cannot start scheduler thread!\n");
         exit(1);
     }
+}
+
+void line_scheduler::stop()
+{
+    if (!started) return;
+    running = 0;
+    pthread_join(thread, NULL);
+    started = false;
+    hook = NULL;
+    tick(true);
+}
+
+line_order::line_order()
+{
+    node = NULL;
+    new_id = NULL;
+}
+
+line_order::~line_order()
+{
+    node = NULL;
+    edge_u.clear();
+    edge_v.clear();
+    if (new_id != NULL) {free(new_id); new_id = NULL;}
+}
+
+void line_order::init(line_node *p_node)
+{
+    node = p_node;
+}
+
+void line_order::add_file(const char *file_name)
+{
+    char word1[MAX_STRING], word2[MAX_STRING];
+    int u, v, ch;
+    long long cnt = 0;
     
-    char word[MAX_STRING];
-    node_size = 0;
+    FILE *fi = fopen(file_name, "rb");
+    if (fi == NULL)
+    {
+        printf("ERROR: edge file for ordering not found!\n");
+        printf("%s\n", file_name);
+        exit(1);
+    }
     while (1)
     {
-        if (fscanf(fi, "%s", word) != 1) break;
-        add_node(word);
+        if (fscanf(fi, "%s %s", word1, word2) != 2) break;
+        while ((ch = fgetc(fi)) != '\n' && ch != EOF);
+        
+        u = node->vocab->search(word1);
+        v = node->vocab->search(word2);
+        if (u == -1 || v == -1) continue;
+        edge_u.push_back(u);
+        edge_v.push_back(v);
+        cnt++;
     }
     fclose(fi);
+    printf("Reading edges for ordering from file: %s, DONE!\n", file_name);
+    printf("Edge size: %lld\n", cnt);
+}
+
+void line_order::build(int mode)
+{
+    int node_size = node->node_size;
+    long long edge_size = edge_u.size();
+    std::vector<long long> deg(node_size, 0);
+    std::vector< std::pair<long long, int> > by_deg(node_size);
+    std::vector<int> seq(node_size);
+    
+    for (long long k = 0; k != edge_size; k++)
+    {
+        deg[edge_u[k]]++;
+        deg[edge_v[k]]++;
+    }
+    for (int i = 0; i != node_size; i++) by_deg[i] = std::make_pair(-deg[i], i);
+    std::sort(by_deg.begin(), by_deg.end());
+    for (int i = 0; i != node_size; i++) seq[i] = by_deg[i].second;
+    
+    if (mode == LINE_ORDER_BFS)
+    {
+        // undirected CSR holding the degree rank of each neighbor, so that
+        // sorting a list visits the neighbors by decreasing degree
+        std::vector<long long> pst(node_size + 1, 0);
+        std::vector<int> nb(2 * edge_size), rank(node_size);
+        for (int i = 0; i != node_size; i++) rank[seq[i]] = i;
+        for (int i = 0; i != node_size; i++) pst[i + 1] = pst[i] + deg[i];
+        std::vector<long long> fill(pst.begin(), pst.end() - 1);
+        for (long long k = 0; k != edge_size; k++)
+        {
+            nb[fill[edge_u[k]]++] = rank[edge_v[k]];
+            nb[fill[edge_v[k]]++] = rank[edge_u[k]];
+        }
+        for (int i = 0; i != node_size; i++) std::sort(nb.begin() + pst[i], nb.begin() + pst[i + 1]);
+        
+        std::vector<int> bfs;
+        std::vector<char> seen(node_size, 0);
+        bfs.reserve(node_size);
+        for (int r = 0; r != node_size; r++)
+        {
+            if (seen[seq[r]]) continue;
+            seen[seq[r]] = 1;
+            bfs.push_back(seq[r]);
+            for (long long head = bfs.size() - 1; head != (long long)bfs.size(); head++)
+            {
+                int u = bfs[head];
+                for (long long k = pst[u]; k != pst[u + 1]; k++) if (!seen[seq[nb[k]]])
+                {
+                    seen[seq[nb[k]]] = 1;
+                    bfs.push_back(seq[nb[k]]);
+                }
+            }
+        }
+        seq.swap(bfs);
+    }
     
-    long long a, b;
-    a = posix_memalign((void **)&_vec, 128, (long long)node_size * vector_size * sizeof(real));
-    if (_vec == NULL) { printf("Memory allocation failed\n"); exit(1); }
-    for (b = 0; b < vector_size; b++) for (a = 0; a < node_size; a++)
-        _vec[a * vector_size + b] = (rand() / (real)RAND_MAX - 0.5) / vector_size;
-    new (&vec) Eigen::Map<BLPMatrix>(_vec, node_size, vector_size);
-    
-    printf("Reading nodes from file: %s, DONE!\n", node_file);
-    printf("Node size: %d\n", node_size);
-    printf("Node dims: %d\n", vector_size);
+    if (new_id != NULL) free(new_id);
+    new_id = (int *)malloc(node_size * sizeof(int));
+    for (int i = 0; i != node_size; i++)
+    {
+        if (mode == LINE_ORDER_NONE) new_id[i] = i;
+        else new_id[seq[i]] = i;
+    }
 }
 
-void line_node::output(const char *file_name, int binary)
+void line_order::apply(line_node *p_node)
 {
-    FILE *fo = fopen(file_name, "wb");
-    fprintf(fo, "%d %d\n", node_size, vector_size);
-    for (int a = 0; a != node_size; a++)
+    if (p_node->vocab != node->vocab)
     {
-        fprintf(fo, "%s ", node[a].word);
-        if (binary) for (int b = 0; b != vector_size; b++) fwrite(&_vec[a * vector_size + b], sizeof(real), 1, fo);
-        else for (int b = 0; b != vector_size; b++) fprintf(fo, "%lf ", _vec[a * vector_size + b]);
-        fprintf(fo, "\n");
+        printf("ERROR: ordering built for another vocabulary!\n");
+        exit(1);
     }
-    fclose(fo);
+    p_node->reorder(new_id);
+}
+
+static long long line_cache_align(long long size)
+{
+    return (size + 63) / 64 * 64;
+}
+
+static void line_cache_write(FILE *fo, const void *data, long long size)
+{
+    static const char zero[64] = {0};
+    if (size > 0 && (long long)fwrite(data, 1, size, fo) != size)
+    {
+        printf("ERROR: cache write failed!\n");
+        exit(1);
+    }
+    if (size % 64 != 0) fwrite(zero, 1, 64 - size % 64, fo);
+}
+
+static void line_cache_source(const char *file_name, long long &size, long long &mtime)
+{
+    struct stat st;
+    size = -1;
+    mtime = -1;
+    if (stat(file_name, &st) != 0) return;
+    size = st.st_size;
+    mtime = st.st_mtime;
+}
+
+// Map a cache file read-only and check its header; returns NULL if the file
+// is missing or was written for another version.
+static char *line_cache_map(const char *cache_file, const char *magic, long long &size)
+{
+    int fd = open(cache_file, O_RDONLY);
+    if (fd == -1) return NULL;
+    struct stat st;
+    if (fstat(fd, &st) != 0 || st.st_size < (long long)sizeof(line_cache_header)) {close(fd); return NULL;}
+    size = st.st_size;
+    char *map = (char *)mmap(NULL, size, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (map == MAP_FAILED) return NULL;
+    line_cache_header *header = (line_cache_header *)map;
+    if (memcmp(header->magic, magic, 8) != 0 || header->version != LINE_CACHE_VERSION)
+    {
+        munmap(map, size);
+        return NULL;
+    }
+    return map;
 }
 
 line_hin::line_hin()
@@ -117,8 +1418,20 @@ line_hin::line_hin()
     hin_file[0] = 0;
     node_u = NULL;
     node_v = NULL;
-    hin = NULL;
     hin_size = 0;
+    typed = true;
+    type_size = 0;
+    for (int k = 0; k != 256; k++) type_index[k] = -1;
+    fw_pst = NULL;
+    bw_pst = NULL;
+    empty_pst = NULL;
+    fw_id = NULL;
+    bw_id = NULL;
+    fw_wei = NULL;
+    bw_wei = NULL;
+    fw_smp = NULL;
+    cache_map = NULL;
+    cache_size = 0;
 }
 
 line_hin::~line_hin()
@@ -126,8 +1439,35 @@ line_hin::~line_hin()
     hin_file[0] = 0;
     node_u = NULL;
     node_v = NULL;
-    if (hin != NULL) {delete [] hin; hin = NULL;}
     hin_size = 0;
+    for (int t = 0; t != type_size; t++)
+    {
+        if (cache_map == NULL)
+        {
+            line_mem_free(fw_pst[t]);
+            line_mem_free(bw_pst[t]);
+        }
+        if (fw_smp[t] != NULL) ransampl_csr_free(fw_smp[t]);
+    }
+    type_size = 0;
+    if (cache_map != NULL)
+    {
+        munmap(cache_map, cache_size);
+        cache_map = NULL;
+        cache_size = 0;
+        fw_id = NULL;
+        bw_id = NULL;
+        fw_wei = NULL;
+        bw_wei = NULL;
+    }
+    if (fw_pst != NULL) {free(fw_pst); fw_pst = NULL;}
+    if (bw_pst != NULL) {free(bw_pst); bw_pst = NULL;}
+    if (fw_smp != NULL) {free(fw_smp); fw_smp = NULL;}
+    if (empty_pst != NULL) {line_mem_free(empty_pst); empty_pst = NULL;}
+    if (fw_id != NULL) {line_mem_free(fw_id); fw_id = NULL;}
+    if (bw_id != NULL) {line_mem_free(bw_id); bw_id = NULL;}
+    if (fw_wei != NULL) {line_mem_free(fw_wei); fw_wei = NULL;}
+    if (bw_wei != NULL) {line_mem_free(bw_wei); bw_wei = NULL;}
 }
 
 void line_hin::init(const char *file_name, line_node *p_u, line_node *p_v, bool with_type)
@@ -136,72 +1476,212 @@ void line_hin::init(const char *file_name, line_node *p_u, line_node *p_v, bool
     
     node_u = p_u;
     node_v = p_v;
+    typed = with_type;
     
-    int node_size = node_u->node_size;
-    hin = new std::vector<hin_nb>[node_size];
+    int nu = node_u->node_size, nv = node_v->node_size;
     
-    FILE *fi = fopen(hin_file, "rb");
-    if (fi == NULL)
+    std::vector<line_load_part> part(line_load_threads);
+    for (int k = 0; k != line_load_threads; k++)
+    {
+        part[k].node[0] = node_u;
+        part[k].node[1] = node_v;
+        part[k].typed = with_type;
+    }
+    line_load_file(hin_file, "hin", part, line_load_hin_part);
+    hin_size = 0;
+    for (int k = 0; k != line_load_threads; k++) hin_size += part[k].id[0].size();
+    
+    // map edge types to dense indices
+    type_size = 0;
+    for (int k = 0; k != line_load_threads; k++) for (size_t e = 0; e != part[k].tp.size(); e++)
+        if (type_index[part[k].tp[e]] == -1) type_index[part[k].tp[e]] = type_size++;
+    
+    fw_pst = (long long **)malloc(type_size * sizeof(long long *));
+    bw_pst = (long long **)malloc(type_size * sizeof(long long *));
+    fw_smp = (ransampl_csr **)malloc(type_size * sizeof(ransampl_csr *));
+    for (int t = 0; t != type_size; t++)
+    {
+        fw_pst[t] = (long long *)line_mem_alloc((nu + 1) * sizeof(long long), LINE_MEM_GRAPH);
+        bw_pst[t] = (long long *)line_mem_alloc((nv + 1) * sizeof(long long), LINE_MEM_GRAPH);
+        fw_smp[t] = NULL;
+    }
+    empty_pst = (long long *)line_mem_alloc(((nu > nv ? nu : nv) + 1) * sizeof(long long), LINE_MEM_GRAPH);
+    fw_id = (int *)line_mem_alloc(hin_size * sizeof(int), LINE_MEM_GRAPH);
+    bw_id = (int *)line_mem_alloc(hin_size * sizeof(int), LINE_MEM_GRAPH);
+    fw_wei = (float *)line_mem_alloc(hin_size * sizeof(float), LINE_MEM_GRAPH);
+    bw_wei = (float *)line_mem_alloc(hin_size * sizeof(float), LINE_MEM_GRAPH);
+    if (fw_id == NULL || bw_id == NULL || fw_wei == NULL || bw_wei == NULL)
     {
-        printf("ERROR: hin file not found!\n");
-        printf("%s\n", hin_file);
+        printf("Error: memory allocation failed!\n");
         exit(1);
     }
-    char word1[MAX_STRING], word2[MAX_STRING], tp;
-    int u, v;
-    double w;
-    hin_nb curnb;
-    if (with_type)
+    
+    // count degrees, then turn them into running end offsets across all types
+    for (int k = 0; k != line_load_threads; k++) for (size_t e = 0; e != part[k].tp.size(); e++)
     {
-        while (fscanf(fi, "%s %s %lf %c", word1, word2, &w, &tp) == 4)
-        {
-            if (hin_size % 10000 == 0)
-            {
-                printf("%lldK%c", hin_size / 1000, 13);
-                fflush(stdout);
-            }
-            
-            u = node_u->search(word1);
-            v = node_v->search(word2);
-            
-            if (u != -1 && v != -1)
-            {
-                curnb.nb_id = v;
-                curnb.eg_tp = tp;
-                curnb.eg_wei = w;
-                hin[u].push_back(curnb);
-                hin_size++;
-            }
-        }
+        int t = type_index[part[k].tp[e]];
+        fw_pst[t][part[k].id[0][e]]++;
+        bw_pst[t][part[k].id[1][e]]++;
     }
-    else
+    long long fw_end = 0, bw_end = 0;
+    for (int t = 0; t != type_size; t++)
     {
-        while (fscanf(fi, "%s %s %lf", word1, word2, &w) == 3)
-        {
-            if (hin_size % 10000 == 0)
-            {
-                printf("%lldK%c", hin_size / 1000, 13);
-                fflush(stdout);
-            }
-            
-            u = node_u->search(word1);
-            v = node_v->search(word2);
-            tp = 0;
-            
-            if (u != -1 && v != -1)
-            {
-                curnb.nb_id = v;
-                curnb.eg_tp = tp;
-                curnb.eg_wei = w;
-                hin[u].push_back(curnb);
-                hin_size++;
-            }
-        }
+        for (int k = 0; k != nu; k++) fw_pst[t][k] = (fw_end += fw_pst[t][k]);
+        fw_pst[t][nu] = fw_end;
+        for (int k = 0; k != nv; k++) bw_pst[t][k] = (bw_end += bw_pst[t][k]);
+        bw_pst[t][nv] = bw_end;
+    }
+    
+    // fill backwards so that each offset ends at the start of its node and
+    // the neighbors keep their file order
+    for (int k = line_load_threads - 1; k >= 0; k--) for (long long e = (long long)part[k].tp.size() - 1; e >= 0; e--)
+    {
+        int t = type_index[part[k].tp[e]], u = part[k].id[0][e], v = part[k].id[1][e];
+        float w = part[k].wei[e];
+        long long pst = --fw_pst[t][u];
+        fw_id[pst] = v;
+        fw_wei[pst] = w;
+        pst = --bw_pst[t][v];
+        bw_id[pst] = u;
+        bw_wei[pst] = w;
     }
-    fclose(fi);
     
     printf("Reading edges from file: %s, DONE!\n", hin_file);
     printf("Edge size: %lld\n", hin_size);
+    printf("Edge types: %d\n", type_size);
+}
+
+void line_hin::save_cache(const char *cache_file)
+{
+    int nu = node_u->node_size, nv = node_v->node_size;
+    FILE *fo = fopen(cache_file, "wb");
+    if (fo == NULL)
+    {
+        printf("ERROR: cannot write cache file!\n");
+        printf("%s\n", cache_file);
+        exit(1);
+    }
+    
+    line_cache_header header;
+    memset(&header, 0, sizeof(header));
+    memcpy(header.magic, "LINEHIN", 8);
+    header.version = LINE_CACHE_VERSION;
+    header.flag = typed;
+    header.sig[0] = node_u->get_signature();
+    header.sig[1] = node_v->get_signature();
+    line_cache_source(hin_file, header.src_size, header.src_mtime);
+    header.size[0] = hin_size;
+    header.size[1] = type_size;
+    
+    line_cache_write(fo, &header, sizeof(header));
+    line_cache_write(fo, type_index, 256 * sizeof(int));
+    for (int t = 0; t != type_size; t++) line_cache_write(fo, fw_pst[t], (nu + 1) * sizeof(long long));
+    for (int t = 0; t != type_size; t++) line_cache_write(fo, bw_pst[t], (nv + 1) * sizeof(long long));
+    line_cache_write(fo, fw_id, hin_size * sizeof(int));
+    line_cache_write(fo, bw_id, hin_size * sizeof(int));
+    line_cache_write(fo, fw_wei, hin_size * sizeof(float));
+    line_cache_write(fo, bw_wei, hin_size * sizeof(float));
+    fclose(fo);
+    
+    printf("Writing edge cache: %s, DONE!\n", cache_file);
+}
+
+bool line_hin::load_cache(const char *cache_file, const char *file_name, line_node *p_u, line_node *p_v, bool with_type)
+{
+    long long size = 0, src_size, src_mtime;
+    char *map = line_cache_map(cache_file, "LINEHIN", size);
+    if (map == NULL) return false;
+    
+    line_cache_header *header = (line_cache_header *)map;
+    line_cache_source(file_name, src_size, src_mtime);
+    if (header->flag != (int)with_type || header->sig[0] != p_u->get_signature() || header->sig[1] != p_v->get_signature() || header->src_size != src_size || header->src_mtime != src_mtime)
+    {
+        printf("Edge cache %s is stale, rebuilding.\n", cache_file);
+        munmap(map, size);
+        return false;
+    }
+    
+    strcpy(hin_file, file_name);
+    node_u = p_u;
+    node_v = p_v;
+    typed = with_type;
+    cache_map = map;
+    cache_size = size;
+    
+    int nu = node_u->node_size, nv = node_v->node_size;
+    hin_size = header->size[0];
+    type_size = header->size[1];
+    
+    char *pt = map + line_cache_align(sizeof(line_cache_header));
+    memcpy(type_index, pt, 256 * sizeof(int));
+    pt += line_cache_align(256 * sizeof(int));
+    fw_pst = (long long **)malloc(type_size * sizeof(long long *));
+    bw_pst = (long long **)malloc(type_size * sizeof(long long *));
+    fw_smp = (ransampl_csr **)malloc(type_size * sizeof(ransampl_csr *));
+    for (int t = 0; t != type_size; t++)
+    {
+        fw_pst[t] = (long long *)pt;
+        pt += line_cache_align((nu + 1) * sizeof(long long));
+        fw_smp[t] = NULL;
+    }
+    for (int t = 0; t != type_size; t++)
+    {
+        bw_pst[t] = (long long *)pt;
+        pt += line_cache_align((nv + 1) * sizeof(long long));
+    }
+    fw_id = (int *)pt;
+    pt += line_cache_align(hin_size * sizeof(int));
+    bw_id = (int *)pt;
+    pt += line_cache_align(hin_size * sizeof(int));
+    fw_wei = (float *)pt;
+    pt += line_cache_align(hin_size * sizeof(float));
+    bw_wei = (float *)pt;
+    pt += line_cache_align(hin_size * sizeof(float));
+    if (pt - map != size)
+    {
+        printf("ERROR: edge cache %s is truncated!\n", cache_file);
+        exit(1);
+    }
+    empty_pst = (long long *)line_mem_alloc(((nu > nv ? nu : nv) + 1) * sizeof(long long), LINE_MEM_GRAPH);
+    
+    printf("Reading edges from cache: %s, DONE!\n", cache_file);
+    printf("Edge size: %lld\n", hin_size);
+    printf("Edge types: %d\n", type_size);
+    return true;
+}
+
+long long *line_hin::get_fw_pst(char edge_type)
+{
+    int t = type_index[(unsigned char)edge_type];
+    if (t == -1) return empty_pst;
+    return fw_pst[t];
+}
+
+long long *line_hin::get_bw_pst(char edge_type)
+{
+    int t = type_index[(unsigned char)edge_type];
+    if (t == -1) return empty_pst;
+    return bw_pst[t];
+}
+
+// Alias tables over the forward edges of one type, built on first use and
+// shared by every trainer and adjacency of that type. Returns NULL for types
+// without edges; callers never draw from a node without neighbors.
+ransampl_csr *line_hin::get_fw_sampler(char edge_type)
+{
+    int t = type_index[(unsigned char)edge_type];
+    if (t == -1) return NULL;
+    if (fw_smp[t] == NULL)
+    {
+        long long *pst = fw_pst[t];
+        long long size = pst[node_u->node_size] - pst[0];
+        double *wei = (double *)malloc((size > 0 ? size : 1) * sizeof(double));
+        for (long long k = 0; k != size; k++) wei[k] = fw_wei[pst[0] + k];
+        fw_smp[t] = ransampl_csr_alloc(node_u->node_size, pst);
+        ransampl_csr_set(fw_smp[t], wei);
+        free(wei);
+    }
+    return fw_smp[t];
 }
 
 line_adjacency::line_adjacency()
@@ -212,13 +1692,11 @@ line_adjacency::line_adjacency()
     node_v = NULL;
     u_wei = NULL;
     smp_u = NULL;
-    u_nb_cnt = NULL;
+    u_nb_pst = NULL;
     u_nb_id = NULL;
-    u_nb_wei = NULL;
     smp_u_nb = NULL;
-    v_nb_cnt = NULL;
+    v_nb_pst = NULL;
     v_nb_id = NULL;
-    v_nb_wei = NULL;
     smp_v_nb = NULL;
 }
 
@@ -226,23 +1704,14 @@ line_adjacency::~line_adjacency()
 {
     adjmode = 1;
     edge_tp = 0;
-    if (u_wei != NULL) {free(u_wei); u_wei = NULL;}
-    if (u_nb_cnt != NULL) {free(u_nb_cnt); u_nb_cnt = NULL;}
-    if (u_nb_id != NULL) {free(u_nb_id); u_nb_id = NULL;}
-    if (u_nb_wei != NULL) {free(u_nb_wei); u_nb_wei = NULL;}
-    if (v_nb_cnt != NULL) {free(v_nb_cnt); v_nb_cnt = NULL;}
-    if (v_nb_id != NULL) {free(v_nb_id); v_nb_id = NULL;}
-    if (v_nb_wei != NULL) {free(v_nb_wei); v_nb_wei = NULL;}
-    if (smp_u_nb != NULL)
-    {
-        free(smp_u_nb);
-        smp_u_nb = NULL;
-    }
-    if (smp_v_nb != NULL)
-    {
-        free(smp_u_nb);
-        smp_u_nb = NULL;
-    }
+    if (u_wei != NULL) {line_mem_free(u_wei); u_wei = NULL;}
+    if (smp_u != NULL) {ransampl_free(smp_u); smp_u = NULL;}
+    if (smp_v_nb != NULL) {ransampl_csr_free(smp_v_nb); smp_v_nb = NULL;}
+    u_nb_pst = NULL;
+    u_nb_id = NULL;
+    smp_u_nb = NULL;
+    v_nb_pst = NULL;
+    v_nb_id = NULL;
 }
 
 void line_adjacency::init(line_hin *p_hin, char edge_type, int mode)
@@ -253,37 +1722,30 @@ void line_adjacency::init(line_hin *p_hin, char edge_type, int mode)
     
     line_node *node_u = phin->node_u, *node_v = phin->node_v;
     
-    long long adj_size = 0;
+    u_nb_pst = phin->get_fw_pst(edge_tp);
+    u_nb_id = phin->fw_id;
+    v_nb_pst = phin->get_bw_pst(edge_tp);
+    v_nb_id = phin->bw_id;
+    
+    long long adj_size = u_nb_pst[node_u->node_size] - u_nb_pst[0];
     
     // compute the degree of vertices
-    u_wei = (double *)calloc(node_u->node_size, sizeof(double));
-    u_nb_cnt = (int *)calloc(node_u->node_size, sizeof(int));
-    v_nb_cnt = (int *)calloc(node_v->node_size, sizeof(int));
+    u_wei = (double *)line_mem_alloc(node_u->node_size * sizeof(double), LINE_MEM_WEIGHT);
     double *u_len = (double *)calloc(node_u->node_size, sizeof(double));
-    
     for (int u = 0; u != node_u->node_size; u++)
     {
-        for (int k = 0; k != (int)(phin->hin[u].size()); k++)
+        for (long long k = u_nb_pst[u]; k != u_nb_pst[u + 1]; k++)
         {
-            int v = phin->hin[u][k].nb_id;
-            char cur_edge_type = phin->hin[u][k].eg_tp;
-            double wei = phin->hin[u][k].eg_wei;
-            
-            if (cur_edge_type != edge_tp) continue;
-            
+            double wei = phin->fw_wei[k];
             u_wei[u] += wei;
-            u_nb_cnt[u] += 1;
-            v_nb_cnt[v] += 1;
             if (adjmode == 21) u_len[u] += wei;
             if (adjmode == 22) u_len[u] += wei * wei;
-            
-            adj_size += 1;
         }
     }
     
     if (adjmode != 1) for (int u = 0; u != node_u->node_size; u++)
     {
-        if (u_nb_cnt[u] == 0) u_wei[u] = 0;
+        if (u_nb_pst[u + 1] == u_nb_pst[u]) u_wei[u] = 0;
         else u_wei[u] = 1;
     }
     smp_u = ransampl_alloc(node_u->node_size);
@@ -295,99 +1757,60 @@ void line_adjacency::init(line_hin *p_hin, char edge_type, int mode)
         else u_len[k] = 1;
     }
     
-    u_nb_id = (int **)malloc(node_u->node_size * sizeof(int *));
-    u_nb_wei = (double **)malloc(node_u->node_size * sizeof(double *));
-    for (int k = 0; k != node_u->node_size; k++)
-    {
-        u_nb_id[k] = (int *)malloc(u_nb_cnt[k] * sizeof(int));
-        u_nb_wei[k] = (double *)malloc(u_nb_cnt[k] * sizeof(double));
-    }
-    
-    v_nb_id = (int **)malloc(node_v->node_size * sizeof(int *));
-    v_nb_wei = (double **)malloc(node_v->node_size * sizeof(double *));
-    for (int k = 0; k != node_v->node_size; k++)
-    {
-        v_nb_id[k] = (int *)malloc(v_nb_cnt[k] * sizeof(int));
-        v_nb_wei[k] = (double *)malloc(v_nb_cnt[k] * sizeof(double));
-    }
-    
-    int *pst_u = (int *)calloc(node_u->node_size, sizeof(int));
-    int *pst_v = (int *)calloc(node_v->node_size, sizeof(int));
-    for (int u = 0; u != node_u->node_size; u++)
+    // Scaling the weights of u by 1 / u_len[u] leaves the distribution over u's
+    // neighbors unchanged, so the forward sampler is the shared one. The reverse
+    // walk is only taken when adjmode != 1, and sees the rescaled weights.
+    smp_u_nb = phin->get_fw_sampler(edge_tp);
+    if (adjmode != 1)
     {
-        for (int k = 0; k != (int)(phin->hin[u].size()); k++)
+        double *v_nb_wei = (double *)malloc((adj_size > 0 ? adj_size : 1) * sizeof(double));
+        for (long long k = 0; k != adj_size; k++)
         {
-            int v = phin->hin[u][k].nb_id;
-            char cur_edge_type = phin->hin[u][k].eg_tp;
-            double wei = phin->hin[u][k].eg_wei;
-            
-            if (cur_edge_type != edge_tp) continue;
-            
-            if (adjmode == 21 || adjmode == 22) wei = wei / u_len[u];
-            
-            u_nb_id[u][pst_u[u]] = v;
-            u_nb_wei[u][pst_u[u]] = wei;
-            pst_u[u]++;
-            
-            v_nb_id[v][pst_v[v]] = u;
-            v_nb_wei[v][pst_v[v]] = wei;
-            pst_v[v]++;
+            long long e = v_nb_pst[0] + k;
+            v_nb_wei[k] = phin->bw_wei[e];
+            if (adjmode == 21 || adjmode == 22) v_nb_wei[k] /= u_len[v_nb_id[e]];
         }
+        smp_v_nb = ransampl_csr_alloc(node_v->node_size, v_nb_pst);
+        ransampl_csr_set(smp_v_nb, v_nb_wei);
+        free(v_nb_wei);
     }
-    free(pst_u);
-    free(pst_v);
     free(u_len);
     
-    smp_u_nb = (ransampl_ws **)malloc(node_u->node_size * sizeof(ransampl_ws *));
-    for (int k = 0; k != node_u->node_size; k++)
-    {
-        if (u_nb_cnt[k] == 0) continue;
-        smp_u_nb[k] = ransampl_alloc(u_nb_cnt[k]);
-        ransampl_set(smp_u_nb[k], u_nb_wei[k]);
-    }
-    
-    smp_v_nb = (ransampl_ws **)malloc(node_v->node_size * sizeof(ransampl_ws *));
-    for (int k = 0; k != node_v->node_size; k++)
-    {
-        if (v_nb_cnt[k] == 0) continue;
-        smp_v_nb[k] = ransampl_alloc(v_nb_cnt[k]);
-        ransampl_set(smp_v_nb[k], v_nb_wei[k]);
-    }
-    
     printf("Reading adjacency from file: %s, DONE!\n", phin->hin_file);
     printf("Adjacency size: %lld\n", adj_size);
 }
 
-int line_adjacency::sample(int u, double (*func_rand_num)())
+int line_adjacency::sample(int u, line_rng *rng)
 {
-    int index, node, v;
+    int node, v;
+    long long index;
     
     if (u == -1) return -1;
     
     if (adjmode == 1)
     {
-        if (u_nb_cnt[u] == 0) return -1;
-        index = (int)(ransampl_draw(smp_u_nb[u], func_rand_num(), func_rand_num()));
-        node = u_nb_id[u][index];
+        if (u_nb_pst[u + 1] == u_nb_pst[u]) return -1;
+        index = ransampl_csr_draw(smp_u_nb, u, rng->rand_num(), rng->rand_num());
+        node = u_nb_id[index];
         return node;
     }
     else
     {
-        if (u_nb_cnt[u] == 0) return -1;
-        index = (int)(ransampl_draw(smp_u_nb[u], func_rand_num(), func_rand_num()));
-        v = u_nb_id[u][index];
+        if (u_nb_pst[u + 1] == u_nb_pst[u]) return -1;
+        index = ransampl_csr_draw(smp_u_nb, u, rng->rand_num(), rng->rand_num());
+        v = u_nb_id[index];
         
-        if (v_nb_cnt[v] == 0) return -1;
-        index = (int)(ransampl_draw(smp_v_nb[v], func_rand_num(), func_rand_num()));
-        node = v_nb_id[v][index];
+        if (v_nb_pst[v + 1] == v_nb_pst[v]) return -1;
+        index = ransampl_csr_draw(smp_v_nb, v, rng->rand_num(), rng->rand_num());
+        node = v_nb_id[index];
         
         return node;
     }
 }
 
-int line_adjacency::sample_head(double (*func_rand_num)())
+int line_adjacency::sample_head(line_rng *rng)
 {
-    return (int)(ransampl_draw(smp_u, func_rand_num(), func_rand_num()));
+    return (int)(ransampl_draw(smp_u, rng->rand_num(), rng->rand_num()));
 }
 
 line_trainer_line::line_trainer_line()
@@ -395,15 +1818,15 @@ line_trainer_line::line_trainer_line()
     edge_tp = 0;
     phin = NULL;
     expTable = NULL;
-    u_nb_cnt = NULL;
+    u_nb_pst = NULL;
     u_nb_id = NULL;
-    u_nb_wei = NULL;
     u_wei = NULL;
     v_wei = NULL;
     smp_u = NULL;
     smp_u_nb = NULL;
     expTable = NULL;
-    neg_table = NULL;
+    smp_neg = NULL;
+    neg_owner = false;
 }
 
 line_trainer_line::~line_trainer_line()
@@ -411,22 +1834,19 @@ line_trainer_line::~line_trainer_line()
     edge_tp = 0;
     phin = NULL;
     if (expTable != NULL) {free(expTable); expTable = NULL;}
-    if (u_nb_cnt != NULL) {free(u_nb_cnt); u_nb_cnt = NULL;}
-    if (u_nb_id != NULL) {free(u_nb_id); u_nb_id = NULL;}
-    if (u_nb_wei != NULL) {free(u_nb_wei); u_nb_wei = NULL;}
-    if (u_wei != NULL) {free(u_wei); u_wei = NULL;}
-    if (v_wei != NULL) {free(v_wei); v_wei = NULL;}
+    u_nb_pst = NULL;
+    u_nb_id = NULL;
+    smp_u_nb = NULL;
+    if (u_wei != NULL) {line_mem_free(u_wei); u_wei = NULL;}
+    if (v_wei != NULL) {line_mem_free(v_wei); v_wei = NULL;}
     if (smp_u != NULL)
     {
         ransampl_free(smp_u);
         smp_u = NULL;
     }
-    if (smp_u_nb != NULL)
-    {
-        free(smp_u_nb);
-        smp_u_nb = NULL;
-    }
-    if (neg_table != NULL) {free(neg_table); neg_table = NULL;}
+    if (smp_neg != NULL && neg_owner) ransampl_free(smp_neg);
+    smp_neg = NULL;
+    neg_owner = false;
 }
 
 void line_trainer_line::init(line_hin *p_hin, char edge_type)
@@ -440,83 +1860,34 @@ void line_trainer_line::init(line_hin *p_hin, char edge_type)
         exit(1);
     }
     
-    // compute the degree of vertices
-    u_nb_cnt = (int *)calloc(node_u->node_size, sizeof(int));
-    u_wei = (double *)calloc(node_u->node_size, sizeof(double));
-    v_wei = (double *)calloc(node_v->node_size, sizeof(double));
-    for (int u = 0; u != node_u->node_size; u++)
-    {
-        for (int k = 0; k != (int)(phin->hin[u].size()); k++)
-        {
-            int v = phin->hin[u][k].nb_id;
-            char cur_edge_type = phin->hin[u][k].eg_tp;
-            double wei = phin->hin[u][k].eg_wei;
-            
-            if (cur_edge_type != edge_tp) continue;
-            
-            u_nb_cnt[u]++;
-            u_wei[u] += wei;
-            v_wei[v] += wei;
-        }
-    }
-    
-    // allocate spaces for edges
-    u_nb_id = (int **)malloc(node_u->node_size * sizeof(int *));
-    u_nb_wei = (double **)malloc(node_u->node_size * sizeof(double *));
-    for (int k = 0; k != node_u->node_size; k++)
-    {
-        u_nb_id[k] = (int *)malloc(u_nb_cnt[k] * sizeof(int));
-        u_nb_wei[k] = (double *)malloc(u_nb_cnt[k] * sizeof(double));
-    }
+    // borrow the neighbors of this edge type from the network
+    u_nb_pst = phin->get_fw_pst(edge_tp);
+    u_nb_id = phin->fw_id;
+    smp_u_nb = phin->get_fw_sampler(edge_tp);
     
-    // read neighbors
-    int *pst = (int *)calloc(node_u->node_size, sizeof(int));
+    // compute the degree of vertices
+    u_wei = (double *)line_mem_alloc(node_u->node_size * sizeof(double), LINE_MEM_WEIGHT);
+    v_wei = (double *)line_mem_alloc(node_v->node_size * sizeof(double), LINE_MEM_WEIGHT);
     for (int u = 0; u != node_u->node_size; u++)
     {
-        for (int k = 0; k != (int)(phin->hin[u].size()); k++)
+        for (long long k = u_nb_pst[u]; k != u_nb_pst[u + 1]; k++)
         {
-            int v = phin->hin[u][k].nb_id;
-            char cur_edge_type = phin->hin[u][k].eg_tp;
-            double wei = phin->hin[u][k].eg_wei;
-            
-            if (cur_edge_type != edge_tp) continue;
-            
-            u_nb_id[u][pst[u]] = v;
-            u_nb_wei[u][pst[u]] = wei;
-            pst[u]++;
+            u_wei[u] += phin->fw_wei[k];
+            v_wei[u_nb_id[k]] += phin->fw_wei[k];
         }
     }
-    free(pst);
     
     // init sampler for edges
-    smp_u = ransampl_alloc(node_u->node_size);
-    ransampl_set(smp_u, u_wei);
-    smp_u_nb = (ransampl_ws **)malloc(node_u->node_size * sizeof(ransampl_ws *));
-    for (int k = 0; k != node_u->node_size; k++)
-    {
-        if (u_nb_cnt[k] == 0) continue;
-        smp_u_nb[k] = ransampl_alloc(u_nb_cnt[k]);
-        ransampl_set(smp_u_nb[k], u_nb_wei[k]);
-    }
-    
-    // Init negative sampling table
-    neg_table = (int *)malloc(neg_table_size * sizeof(int));
-    
-    int a, i;
-    double total_pow = 0, d1;
-    double power = 0.75;
-    for (a = 0; a < node_v->node_size; a++) total_pow += pow(v_wei[a], power);
-    a = 0; i = 0;
-    d1 = pow(v_wei[i], power) / (double)total_pow;
-    while (a < neg_table_size) {
-        if ((a + 1) / (double)neg_table_size > d1) {
-            i++;
-            if (i >= node_v->node_size) {i = node_v->node_size - 1; d1 = 2;}
-            d1 += pow(v_wei[i], power) / (double)total_pow;
-        }
-        else
-            neg_table[a++] = i;
-    }
+    smp_u = ransampl_alloc(node_u->node_size);
+    ransampl_set(smp_u, u_wei);
+    
+    // Init negative sampler
+    double *neg_wei = (double *)malloc(node_v->node_size * sizeof(double));
+    for (int k = 0; k != node_v->node_size; k++) neg_wei[k] = pow(v_wei[k], 0.75);
+    smp_neg = ransampl_alloc(node_v->node_size);
+    ransampl_set(smp_neg, neg_wei);
+    neg_owner = true;
+    free(neg_wei);
     
     expTable = (real *)malloc((EXP_TABLE_SIZE + 1) * sizeof(real));
     for (int i = 0; i < EXP_TABLE_SIZE; i++) {
@@ -536,66 +1907,152 @@ void line_trainer_line::copy_neg_table(line_trainer_line *p_trainer_line)
     int node_size = phin->node_v->node_size;
     
     for (int k = 0; k != node_size; k++) v_wei[k] = p_trainer_line->v_wei[k];
-    for (int k = 0; k != neg_table_size; k++) neg_table[k] = p_trainer_line->neg_table[k];
+    
+    // the sampler is read-only during training, so share it instead of copying
+    if (smp_neg != NULL && neg_owner) ransampl_free(smp_neg);
+    smp_neg = p_trainer_line->smp_neg;
+    neg_owner = false;
 }
 
 void line_trainer_line::train_uv(int u, int v, real lr, int neg_samples, real *_error_vec, unsigned long long &rand_index)
 {
-    int target, label, vector_size;
-    real f, g;
+    int target[LINE_NEG_BATCH], label[LINE_NEG_BATCH], cnt = 0, vector_size;
     line_node *node_u = phin->node_u, *node_v = phin->node_v;
     
     vector_size = node_u->vector_size;
     Eigen::Map<BLPVector> error_vec(_error_vec, vector_size);
     error_vec.setZero();
+    // rows are read through get_row so that compact storage is converted once per use
+    Eigen::Map<BLPVector> vec_u(node_u->get_row(u, _error_vec + vector_size), vector_size);
     
+    // draw the targets first and prefetch their rows, so that the misses overlap
     for (int d = 0; d < neg_samples + 1; d++)
     {
         if (d == 0)
         {
-            target = v;
-            label = 1;
+            target[cnt] = v;
+            label[cnt] = 1;
         }
         else
         {
+            double ran1, ran2;
             rand_index = rand_index * (unsigned long long)25214903917 + 11;
-            target = neg_table[(rand_index >> 16) % neg_table_size];
-            if (target == v) continue;
-            label = 0;
+            ran1 = ((rand_index >> 16) & 0xFFFFFFFF) / 4294967296.0;
+            rand_index = rand_index * (unsigned long long)25214903917 + 11;
+            ran2 = ((rand_index >> 16) & 0xFFFFFFFF) / 4294967296.0;
+            target[cnt] = (int)(ransampl_draw(smp_neg, ran1, ran2));
+            if (target[cnt] == v) continue;
+            label[cnt] = 0;
+        }
+        node_v->prefetch_row(target[cnt]);
+        if (++cnt == LINE_NEG_BATCH)
+        {
+            train_batch(cnt, target, label, lr, vec_u.data(), _error_vec, _error_vec + 2 * vector_size);
+            cnt = 0;
         }
-        f = node_u->vec.row(u) * node_v->vec.row(target).transpose();
-        if (f > MAX_EXP) g = (label - 1) * lr;
-        else if (f < -MAX_EXP) g = (label - 0) * lr;
-        else g = (label - expTable[(int)((f + MAX_EXP) * (EXP_TABLE_SIZE / MAX_EXP / 2))]) * lr;
-        error_vec += g * ((node_v->vec.row(target)));
-        node_v->vec.row(target) += g * ((node_u->vec.row(u)));
     }
-    node_u->vec.row(u) += error_vec;
+    if (cnt > 0) train_batch(cnt, target, label, lr, vec_u.data(), _error_vec, _error_vec + 2 * vector_size);
+    
+    vec_u += error_vec;
+    node_u->put_row(u, vec_u.data());
     new (&error_vec) Eigen::Map<BLPMatrix>(NULL, 0, 0);
 }
 
-void line_trainer_line::train_sample(real lr, int neg_samples, real *_error_vec, double (*func_rand_num)(), unsigned long long &rand_index)
+// Gather the rows of cnt targets into _block, score them against u with one
+// dot product per row, add their gradient to the error of u and scatter the
+// updates back. A target drawn twice is scored once per draw against its old row,
+// but both updates land since each one is added to the current row.
+void line_trainer_line::train_batch(int cnt, int *target, int *label, real lr, real *_u, real *_error_vec, real *_block)
+{
+    int vector_size = phin->node_u->vector_size;
+    line_node *node_v = phin->node_v;
+    real f[LINE_NEG_BATCH], g[LINE_NEG_BATCH];
+    
+    for (int k = 0; k != cnt; k++)
+    {
+        real *row = node_v->get_row(target[k], _block + k * vector_size);
+        if (row != _block + k * vector_size) memcpy(_block + k * vector_size, row, vector_size * sizeof(real));
+    }
+    Eigen::Map<BLPMatrix> rows(_block, cnt, vector_size);
+    Eigen::Map<BLPVector> vec_u(_u, vector_size);
+    Eigen::Map<BLPVector> error_vec(_error_vec, vector_size);
+    
+    // plain dot products: an Eigen product into the LINE_NEG_BATCH floats of f may store a full SIMD width
+    for (int k = 0; k != cnt; k++)
+    {
+        f[k] = vec_u.dot(rows.row(k));
+        if (f[k] > MAX_EXP) g[k] = (label[k] - 1) * lr;
+        else if (f[k] < -MAX_EXP) g[k] = (label[k] - 0) * lr;
+        else g[k] = (label[k] - expTable[(int)((f[k] + MAX_EXP) * (EXP_TABLE_SIZE / MAX_EXP / 2))]) * lr;
+    }
+    for (int k = 0; k != cnt; k++) error_vec += g[k] * rows.row(k);
+    
+    for (int k = 0; k != cnt; k++)
+    {
+        Eigen::Map<BLPVector> vec_v(node_v->get_row(target[k], _block + k * vector_size), vector_size);
+        vec_v += g[k] * vec_u;
+        node_v->put_row(target[k], vec_v.data());
+    }
+}
+
+void line_trainer_line::train_sample(real lr, int neg_samples, real *_error_vec, line_rng *rng, unsigned long long &rand_index, line_prefetch *pf)
 {
-    int u, v, index;
+    int u, v, unused;
+    long long index;
+    unsigned long long start = pf != NULL ? line_cycles() : 0;
     
-    u = (int)(ransampl_draw(smp_u, func_rand_num(), func_rand_num()));
-    if (u_nb_cnt[u] == 0) return;
-    index = (int)(ransampl_draw(smp_u_nb[u], func_rand_num(), func_rand_num()));
-    v = u_nb_id[u][index];
+    if (pf != NULL && pf->distance > 0)
+    {
+        // keep distance edges queued with their rows on the way; v is -1 if u has no edge
+        while (pf->size < pf->distance)
+        {
+            u = (int)(ransampl_draw(smp_u, rng->rand_num(), rng->rand_num()));
+            v = -1;
+            if (u_nb_pst[u + 1] != u_nb_pst[u])
+            {
+                index = ransampl_csr_draw(smp_u_nb, u, rng->rand_num(), rng->rand_num());
+                v = u_nb_id[index];
+                phin->node_u->prefetch_row(u);
+                phin->node_v->prefetch_row(v);
+                pf->issued[LINE_PREFETCH_LINE] += 2;
+            }
+            pf->push(u, v, 0);
+        }
+        long long a;
+        pf->pop(a, v, unused);
+        u = (int)a;
+        if (v != -1) train_uv(u, v, lr, neg_samples, _error_vec, rand_index);
+    }
+    else
+    {
+        u = (int)(ransampl_draw(smp_u, rng->rand_num(), rng->rand_num()));
+        if (u_nb_pst[u + 1] != u_nb_pst[u])
+        {
+            index = ransampl_csr_draw(smp_u_nb, u, rng->rand_num(), rng->rand_num());
+            v = u_nb_id[index];
+            train_uv(u, v, lr, neg_samples, _error_vec, rand_index);
+        }
+    }
     
-    train_uv(u, v, lr, neg_samples, _error_vec, rand_index);
+    if (pf != NULL)
+    {
+        pf->samples[LINE_PREFETCH_LINE]++;
+        pf->cycles[LINE_PREFETCH_LINE] += line_cycles() - start;
+    }
 }
 
-void line_trainer_line::train_sample_depth(real lr, int neg_samples, real *_error_vec, double (*func_rand_num)(), unsigned long long &rand_index, int depth, line_adjacency *p_adjacency, char pst)
+void line_trainer_line::train_sample_depth(real lr, int neg_samples, real *_error_vec, line_rng *rng, unsigned long long &rand_index, int depth, line_adjacency *p_adjacency, char pst)
 {
-    int u, v, index;
+    int u, v;
+    long long index;
     std::vector<int> node_lst;
     
     node_lst.clear();
     
-    u = (int)(ransampl_draw(smp_u, func_rand_num(), func_rand_num()));
-    index = (int)(ransampl_draw(smp_u_nb[u], func_rand_num(), func_rand_num()));
-    v = u_nb_id[u][index];
+    u = (int)(ransampl_draw(smp_u, rng->rand_num(), rng->rand_num()));
+    if (u_nb_pst[u + 1] == u_nb_pst[u]) return;
+    index = ransampl_csr_draw(smp_u_nb, u, rng->rand_num(), rng->rand_num());
+    v = u_nb_id[index];
     
     if (pst == 'r')
     {
@@ -603,7 +2060,7 @@ void line_trainer_line::train_sample_depth(real lr, int neg_samples, real *_erro
         
         for (int k = 1; k != depth; k++)
         {
-            v = p_adjacency->sample(v, func_rand_num);
+            v = p_adjacency->sample(v, rng);
             node_lst.push_back(v);
         }
         
@@ -620,7 +2077,7 @@ void line_trainer_line::train_sample_depth(real lr, int neg_samples, real *_erro
         
         for (int k = 1; k != depth; k++)
         {
-            u = p_adjacency->sample(u, func_rand_num);
+            u = p_adjacency->sample(u, rng);
             node_lst.push_back(u);
         }
         
@@ -637,34 +2094,29 @@ line_trainer_norm::line_trainer_norm()
 {
     edge_tp = 0;
     phin = NULL;
-    u_nb_cnt = NULL;
+    u_nb_pst = NULL;
     u_nb_id = NULL;
-    u_nb_wei = NULL;
     u_wei = NULL;
     v_wei = NULL;
     smp_u = NULL;
     smp_u_nb = NULL;
+    for (int k = 0; k != 3; k++) kernel[k] = NULL;
 }
 
 line_trainer_norm::~line_trainer_norm()
 {
     edge_tp = 0;
     phin = NULL;
-    if (u_nb_cnt != NULL) {free(u_nb_cnt); u_nb_cnt = NULL;}
-    if (u_nb_id != NULL) {free(u_nb_id); u_nb_id = NULL;}
-    if (u_nb_wei != NULL) {free(u_nb_wei); u_nb_wei = NULL;}
-    if (u_wei != NULL) {free(u_wei); u_wei = NULL;}
-    if (v_wei != NULL) {free(v_wei); v_wei = NULL;}
+    u_nb_pst = NULL;
+    u_nb_id = NULL;
+    smp_u_nb = NULL;
+    if (u_wei != NULL) {line_mem_free(u_wei); u_wei = NULL;}
+    if (v_wei != NULL) {line_mem_free(v_wei); v_wei = NULL;}
     if (smp_u != NULL)
     {
         ransampl_free(smp_u);
         smp_u = NULL;
     }
-    if (smp_u_nb != NULL)
-    {
-        free(smp_u_nb);
-        smp_u_nb = NULL;
-    }
 }
 
 void line_trainer_norm::init(line_hin *p_hin, char edge_type)
@@ -677,65 +2129,34 @@ void line_trainer_norm::init(line_hin *p_hin, char edge_type)
         printf("ERROR: vector dimsions are not same!\n");
         exit(1);
     }
-    
-    // compute the degree of vertices
-    u_nb_cnt = (int *)calloc(node_u->node_size, sizeof(int));
-    u_wei = (double *)calloc(node_u->node_size, sizeof(double));
-    v_wei = (double *)calloc(node_v->node_size, sizeof(double));
-    for (int u = 0; u != node_u->node_size; u++)
+    if (node_u->storage != LINE_STORAGE_FP32 || node_v->storage != LINE_STORAGE_FP32)
     {
-        for (int k = 0; k != (int)(phin->hin[u].size()); k++)
-        {
-            int v = phin->hin[u][k].nb_id;
-            char cur_edge_type = phin->hin[u][k].eg_tp;
-            double wei = phin->hin[u][k].eg_wei;
-            
-            if (cur_edge_type != edge_tp) continue;
-            
-            u_nb_cnt[u]++;
-            u_wei[u] += wei;
-            v_wei[v] += wei;
-        }
+        printf("ERROR: this trainer needs fp32 node storage!\n");
+        exit(1);
     }
     
-    // allocate spaces for edges
-    u_nb_id = (int **)malloc(node_u->node_size * sizeof(int *));
-    u_nb_wei = (double **)malloc(node_u->node_size * sizeof(double *));
-    for (int k = 0; k != node_u->node_size; k++)
-    {
-        u_nb_id[k] = (int *)malloc(u_nb_cnt[k] * sizeof(int));
-        u_nb_wei[k] = (double *)malloc(u_nb_cnt[k] * sizeof(double));
-    }
+    for (int k = 0; k != 3; k++) kernel[k] = line_kernel_select(k, node_u->vector_size);
     
-    // read neighbors
-    int *pst = (int *)calloc(node_u->node_size, sizeof(int));
+    // borrow the neighbors of this edge type from the network
+    u_nb_pst = phin->get_fw_pst(edge_tp);
+    u_nb_id = phin->fw_id;
+    smp_u_nb = phin->get_fw_sampler(edge_tp);
+    
+    // compute the degree of vertices
+    u_wei = (double *)line_mem_alloc(node_u->node_size * sizeof(double), LINE_MEM_WEIGHT);
+    v_wei = (double *)line_mem_alloc(node_v->node_size * sizeof(double), LINE_MEM_WEIGHT);
     for (int u = 0; u != node_u->node_size; u++)
     {
-        for (int k = 0; k != (int)(phin->hin[u].size()); k++)
+        for (long long k = u_nb_pst[u]; k != u_nb_pst[u + 1]; k++)
         {
-            int v = phin->hin[u][k].nb_id;
-            char cur_edge_type = phin->hin[u][k].eg_tp;
-            double wei = phin->hin[u][k].eg_wei;
-            
-            if (cur_edge_type != edge_tp) continue;
-            
-            u_nb_id[u][pst[u]] = v;
-            u_nb_wei[u][pst[u]] = wei;
-            pst[u]++;
+            u_wei[u] += phin->fw_wei[k];
+            v_wei[u_nb_id[k]] += phin->fw_wei[k];
         }
     }
-    free(pst);
     
     // init sampler for edges
     smp_u = ransampl_alloc(node_u->node_size);
     ransampl_set(smp_u, u_wei);
-    smp_u_nb = (ransampl_ws **)malloc(node_u->node_size * sizeof(ransampl_ws *));
-    for (int k = 0; k != node_u->node_size; k++)
-    {
-        if (u_nb_cnt[k] == 0) continue;
-        smp_u_nb[k] = ransampl_alloc(u_nb_cnt[k]);
-        ransampl_set(smp_u_nb[k], u_nb_wei[k]);
-    }
 }
 
 void line_trainer_norm::train_uv(int u, int v, real lr, real margin, int dis_type, real *_error_vec, double randv)
@@ -743,82 +2164,51 @@ void line_trainer_norm::train_uv(int u, int v, real lr, real margin, int dis_typ
     int n, vector_size;
     real dpos = 0, dneg = 0;
     line_node *node_u = phin->node_u, *node_v = phin->node_v;
+    const line_kernel_set *ks = kernel[dis_type == 1 || dis_type == 2 ? dis_type : 0];
     
     vector_size = node_u->vector_size;
-    Eigen::Map<BLPVector> error_vec(_error_vec, vector_size);
-    error_vec.setZero();
-    
     n = node_v->node_size * randv;
     
-    if (dis_type == 1)
-    {
-        dpos = (node_u->vec.row(u) - node_v->vec.row(v)).array().abs().sum();
-        dneg = (node_u->vec.row(u) - node_v->vec.row(n)).array().abs().sum();
-    }
-    else if (dis_type == 2)
-    {
-        dpos = (node_u->vec.row(u) - node_v->vec.row(v)).array().pow(2).sum();
-        dneg = (node_u->vec.row(u) - node_v->vec.row(n)).array().pow(2).sum();
-    }
+    real *_u = node_u->_vec + (long long)u * vector_size;
+    real *_v = node_v->_vec + (long long)v * vector_size;
+    real *_n = node_v->_vec + (long long)n * vector_size;
+    ks->dist(vector_size, _u, _v, _n, &dpos, &dneg);
     
     if (dneg - dpos < margin)
     {
-        real x = 0;
-        for (int c = 0; c != vector_size; c++)
-        {
-            if (dis_type == 1)
-            {
-                x = 2 * (node_u->vec(u, c) - node_v->vec(v, c));
-                if (x > 0) x = 1;
-                else x = -1;
-            }
-            else if (dis_type == 2)
-            {
-                x = 2 * (node_u->vec(u, c) - node_v->vec(v, c));
-            }
-            node_v->vec(v, c) += lr * x;
-            error_vec(c) -= lr * x;
-            
-            if (dis_type == 1)
-            {
-                x = 2 * (node_u->vec(u, c) - node_v->vec(n, c));
-                if (x > 0) x = 1;
-                else x = -1;
-            }
-            else if (dis_type == 2)
-            {
-                x = 2 * (node_u->vec(u, c) - node_v->vec(n, c));
-            }
-            node_v->vec(n, c) -= lr * x;
-            error_vec(c) += lr * x;
-        }
-        node_u->vec.row(u) += error_vec;
+        ks->margin(vector_size, lr, _u, _v, _n, _error_vec);
+        for (int c = 0; c != vector_size; c++) _u[c] += _error_vec[c];
+        node_u->update_norm(u);
+        node_v->update_norm(v);
+        node_v->update_norm(n);
     }
-    new (&error_vec) Eigen::Map<BLPMatrix>(NULL, 0, 0);
 }
 
-void line_trainer_norm::train_sample(real lr, real margin, int dis_type, real *_error_vec, double (*func_rand_num)())
+void line_trainer_norm::train_sample(real lr, real margin, int dis_type, real *_error_vec, line_rng *rng)
 {
-    int u, v, index;
+    int u, v;
+    long long index;
     
-    u = (int)(ransampl_draw(smp_u, func_rand_num(), func_rand_num()));
-    if (u_nb_cnt[u] == 0) return;
-    index = (int)(ransampl_draw(smp_u_nb[u], func_rand_num(), func_rand_num()));
-    v = u_nb_id[u][index];
+    u = (int)(ransampl_draw(smp_u, rng->rand_num(), rng->rand_num()));
+    if (u_nb_pst[u + 1] == u_nb_pst[u]) return;
+    index = ransampl_csr_draw(smp_u_nb, u, rng->rand_num(), rng->rand_num());
+    v = u_nb_id[index];
     
-    train_uv(u, v, lr, margin, dis_type, _error_vec, func_rand_num());
+    train_uv(u, v, lr, margin, dis_type, _error_vec, rng->rand_num());
 }
 
-void line_trainer_norm::train_sample_depth(real lr, real margin, int dis_type, real *_error_vec, double (*func_rand_num)(), int depth, line_adjacency *p_adjacency, char pst)
+void line_trainer_norm::train_sample_depth(real lr, real margin, int dis_type, real *_error_vec, line_rng *rng, int depth, line_adjacency *p_adjacency, char pst)
 {
-    int u, v, index;
+    int u, v;
+    long long index;
     std::vector<int> node_lst;
     
     node_lst.clear();
     
-    u = (int)(ransampl_draw(smp_u, func_rand_num(), func_rand_num()));
-    index = (int)(ransampl_draw(smp_u_nb[u], func_rand_num(), func_rand_num()));
-    v = u_nb_id[u][index];
+    u = (int)(ransampl_draw(smp_u, rng->rand_num(), rng->rand_num()));
+    if (u_nb_pst[u + 1] == u_nb_pst[u]) return;
+    index = ransampl_csr_draw(smp_u_nb, u, rng->rand_num(), rng->rand_num());
+    v = u_nb_id[index];
     
     if (pst == 'r')
     {
@@ -826,7 +2216,7 @@ void line_trainer_norm::train_sample_depth(real lr, real margin, int dis_type, r
         
         for (int k = 1; k != depth; k++)
         {
-            v = p_adjacency->sample(v, func_rand_num);
+            v = p_adjacency->sample(v, rng);
             node_lst.push_back(v);
         }
         
@@ -834,7 +2224,7 @@ void line_trainer_norm::train_sample_depth(real lr, real margin, int dis_type, r
         {
             v = node_lst[k];
             if (v == -1) continue;
-            train_uv(u, v, lr, margin, dis_type, _error_vec, func_rand_num());
+            train_uv(u, v, lr, margin, dis_type, _error_vec, rng->rand_num());
         }
     }
     else if (pst == 'l')
@@ -843,7 +2233,7 @@ void line_trainer_norm::train_sample_depth(real lr, real margin, int dis_type, r
         
         for (int k = 1; k != depth; k++)
         {
-            u = p_adjacency->sample(u, func_rand_num);
+            u = p_adjacency->sample(u, rng);
             node_lst.push_back(u);
         }
         
@@ -851,7 +2241,7 @@ void line_trainer_norm::train_sample_depth(real lr, real margin, int dis_type, r
         {
             u = node_lst[k];
             if (u == -1) continue;
-            train_uv(u, v, lr, margin, dis_type, _error_vec, func_rand_num());
+            train_uv(u, v, lr, margin, dis_type, _error_vec, rng->rand_num());
         }
     }
 }
@@ -860,9 +2250,8 @@ line_trainer_reg::line_trainer_reg()
 {
     edge_tp = 0;
     phin = NULL;
-    u_nb_cnt = NULL;
+    u_nb_pst = NULL;
     u_nb_id = NULL;
-    u_nb_wei = NULL;
     u_wei = NULL;
     v_wei = NULL;
     smp_u = NULL;
@@ -873,21 +2262,16 @@ line_trainer_reg::~line_trainer_reg()
 {
     edge_tp = 0;
     phin = NULL;
-    if (u_nb_cnt != NULL) {free(u_nb_cnt); u_nb_cnt = NULL;}
-    if (u_nb_id != NULL) {free(u_nb_id); u_nb_id = NULL;}
-    if (u_nb_wei != NULL) {free(u_nb_wei); u_nb_wei = NULL;}
-    if (u_wei != NULL) {free(u_wei); u_wei = NULL;}
-    if (v_wei != NULL) {free(v_wei); v_wei = NULL;}
+    u_nb_pst = NULL;
+    u_nb_id = NULL;
+    smp_u_nb = NULL;
+    if (u_wei != NULL) {line_mem_free(u_wei); u_wei = NULL;}
+    if (v_wei != NULL) {line_mem_free(v_wei); v_wei = NULL;}
     if (smp_u != NULL)
     {
         ransampl_free(smp_u);
         smp_u = NULL;
     }
-    if (smp_u_nb != NULL)
-    {
-        free(smp_u_nb);
-        smp_u_nb = NULL;
-    }
 }
 
 void line_trainer_reg::init(line_hin *p_hin, char edge_type)
@@ -900,65 +2284,32 @@ void line_trainer_reg::init(line_hin *p_hin, char edge_type)
         printf("ERROR: vector dimsions are not same!\n");
         exit(1);
     }
-    
-    // compute the degree of vertices
-    u_nb_cnt = (int *)calloc(node_u->node_size, sizeof(int));
-    u_wei = (double *)calloc(node_u->node_size, sizeof(double));
-    v_wei = (double *)calloc(node_v->node_size, sizeof(double));
-    for (int u = 0; u != node_u->node_size; u++)
+    if (node_u->storage != LINE_STORAGE_FP32 || node_v->storage != LINE_STORAGE_FP32)
     {
-        for (int k = 0; k != (int)(phin->hin[u].size()); k++)
-        {
-            int v = phin->hin[u][k].nb_id;
-            char cur_edge_type = phin->hin[u][k].eg_tp;
-            double wei = phin->hin[u][k].eg_wei;
-            
-            if (cur_edge_type != edge_tp) continue;
-            
-            u_nb_cnt[u]++;
-            u_wei[u] += wei;
-            v_wei[v] += wei;
-        }
+        printf("ERROR: this trainer needs fp32 node storage!\n");
+        exit(1);
     }
     
-    // allocate spaces for edges
-    u_nb_id = (int **)malloc(node_u->node_size * sizeof(int *));
-    u_nb_wei = (double **)malloc(node_u->node_size * sizeof(double *));
-    for (int k = 0; k != node_u->node_size; k++)
-    {
-        u_nb_id[k] = (int *)malloc(u_nb_cnt[k] * sizeof(int));
-        u_nb_wei[k] = (double *)malloc(u_nb_cnt[k] * sizeof(double));
-    }
+    // borrow the neighbors of this edge type from the network
+    u_nb_pst = phin->get_fw_pst(edge_tp);
+    u_nb_id = phin->fw_id;
+    smp_u_nb = phin->get_fw_sampler(edge_tp);
     
-    // read neighbors
-    int *pst = (int *)calloc(node_u->node_size, sizeof(int));
+    // compute the degree of vertices
+    u_wei = (double *)line_mem_alloc(node_u->node_size * sizeof(double), LINE_MEM_WEIGHT);
+    v_wei = (double *)line_mem_alloc(node_v->node_size * sizeof(double), LINE_MEM_WEIGHT);
     for (int u = 0; u != node_u->node_size; u++)
     {
-        for (int k = 0; k != (int)(phin->hin[u].size()); k++)
+        for (long long k = u_nb_pst[u]; k != u_nb_pst[u + 1]; k++)
         {
-            int v = phin->hin[u][k].nb_id;
-            char cur_edge_type = phin->hin[u][k].eg_tp;
-            double wei = phin->hin[u][k].eg_wei;
-            
-            if (cur_edge_type != edge_tp) continue;
-            
-            u_nb_id[u][pst[u]] = v;
-            u_nb_wei[u][pst[u]] = wei;
-            pst[u]++;
+            u_wei[u] += phin->fw_wei[k];
+            v_wei[u_nb_id[k]] += phin->fw_wei[k];
         }
     }
-    free(pst);
     
     // init sampler for edges
     smp_u = ransampl_alloc(node_u->node_size);
     ransampl_set(smp_u, u_wei);
-    smp_u_nb = (ransampl_ws **)malloc(node_u->node_size * sizeof(ransampl_ws *));
-    for (int k = 0; k != node_u->node_size; k++)
-    {
-        if (u_nb_cnt[k] == 0) continue;
-        smp_u_nb[k] = ransampl_alloc(u_nb_cnt[k]);
-        ransampl_set(smp_u_nb[k], u_nb_wei[k]);
-    }
 }
 
 void line_trainer_reg::train_uv(int u, int v, real lr)
@@ -974,30 +2325,35 @@ void line_trainer_reg::train_uv(int u, int v, real lr)
         node_u->vec(u, c) -= lr * f;
         node_v->vec(v, c) += lr * f;
     }
+    node_u->update_norm(u);
+    node_v->update_norm(v);
 }
 
-void line_trainer_reg::train_sample(real lr, double (*func_rand_num)())
+void line_trainer_reg::train_sample(real lr, line_rng *rng)
 {
-    int u, v, index;
+    int u, v;
+    long long index;
     
-    u = (int)(ransampl_draw(smp_u, func_rand_num(), func_rand_num()));
-    if (u_nb_cnt[u] == 0) return;
-    index = (int)(ransampl_draw(smp_u_nb[u], func_rand_num(), func_rand_num()));
-    v = u_nb_id[u][index];
+    u = (int)(ransampl_draw(smp_u, rng->rand_num(), rng->rand_num()));
+    if (u_nb_pst[u + 1] == u_nb_pst[u]) return;
+    index = ransampl_csr_draw(smp_u_nb, u, rng->rand_num(), rng->rand_num());
+    v = u_nb_id[index];
     
     train_uv(u, v, lr);
 }
 
-void line_trainer_reg::train_sample_depth(real lr, double (*func_rand_num)(), int depth, line_adjacency *p_adjacency, char pst)
+void line_trainer_reg::train_sample_depth(real lr, line_rng *rng, int depth, line_adjacency *p_adjacency, char pst)
 {
-    int u, v, index;
+    int u, v;
+    long long index;
     std::vector<int> node_lst;
     
     node_lst.clear();
     
-    u = (int)(ransampl_draw(smp_u, func_rand_num(), func_rand_num()));
-    index = (int)(ransampl_draw(smp_u_nb[u], func_rand_num(), func_rand_num()));
-    v = u_nb_id[u][index];
+    u = (int)(ransampl_draw(smp_u, rng->rand_num(), rng->rand_num()));
+    if (u_nb_pst[u + 1] == u_nb_pst[u]) return;
+    index = ransampl_csr_draw(smp_u_nb, u, rng->rand_num(), rng->rand_num());
+    v = u_nb_id[index];
     
     if (pst == 'r')
     {
@@ -1005,7 +2361,7 @@ void line_trainer_reg::train_sample_depth(real lr, double (*func_rand_num)(), in
         
         for (int k = 1; k != depth; k++)
         {
-            v = p_adjacency->sample(v, func_rand_num);
+            v = p_adjacency->sample(v, rng);
             node_lst.push_back(v);
         }
         
@@ -1022,7 +2378,7 @@ void line_trainer_reg::train_sample_depth(real lr, double (*func_rand_num)(), in
         
         for (int k = 1; k != depth; k++)
         {
-            u = p_adjacency->sample(u, func_rand_num);
+            u = p_adjacency->sample(u, rng);
             node_lst.push_back(u);
         }
         
@@ -1035,289 +2391,1003 @@ void line_trainer_reg::train_sample_depth(real lr, double (*func_rand_num)(), in
     }
 }
 
-line_triple::line_triple()
+line_triple::line_triple()
+{
+    node_h = NULL;
+    node_t = NULL;
+    node_r = NULL;
+    triple_size = 0;
+    triple_h = NULL;
+    triple_t = NULL;
+    triple_r = NULL;
+    triple_file[0] = 0;
+    appear = NULL;
+    appear_size = 0;
+    cache_map = NULL;
+    cache_size = 0;
+    focus_id = NULL;
+    focus_size = 0;
+    focus_rate = 0;
+    neg_h_begin = 0;
+    neg_h_end = 0;
+    neg_t_begin = 0;
+    neg_t_end = 0;
+    neg_skipped = 0;
+    for (int k = 0; k != 3; k++) kernel[k] = NULL;
+}
+
+line_triple::~line_triple()
+{
+    node_h = NULL;
+    node_t = NULL;
+    node_r = NULL;
+    triple_size = 0;
+    if (cache_map != NULL)
+    {
+        munmap(cache_map, cache_size);
+        cache_map = NULL;
+        cache_size = 0;
+        triple_h = NULL;
+        triple_t = NULL;
+        triple_r = NULL;
+        appear = NULL;
+    }
+    if (triple_h != NULL) {line_mem_free(triple_h); triple_h = NULL;}
+    if (triple_t != NULL) {line_mem_free(triple_t); triple_t = NULL;}
+    if (triple_r != NULL) {line_mem_free(triple_r); triple_r = NULL;}
+    triple_file[0] = 0;
+    if (appear != NULL) {line_mem_free(appear); appear = NULL;}
+    appear_size = 0;
+    if (focus_id != NULL) {line_mem_free(focus_id); focus_id = NULL;}
+    focus_size = 0;
+}
+
+unsigned long long line_triple::triple_key(int h, int t, int r)
+{
+    return ((unsigned long long)h * node_r->node_size + r) * node_t->node_size + t;
+}
+
+static inline unsigned long long line_mix_key(unsigned long long key)
+{
+    key ^= key >> 33;
+    key *= 0xFF51AFD7ED558CCDULL;
+    key ^= key >> 33;
+    key *= 0xC4CEB9FE1A85EC53ULL;
+    key ^= key >> 33;
+    return key;
+}
+
+// slot of a hashed key in a table of size slots, without a division
+static inline long long line_hash_slot(unsigned long long hash, long long size)
+{
+    return (long long)(((unsigned __int128)hash * (unsigned long long)size) >> 64);
+}
+
+void line_triple::add_appear(int h, int t, int r)
+{
+    unsigned long long key = triple_key(h, t, r);
+    long long pst = line_hash_slot(line_mix_key(key), appear_size);
+    while (appear[pst] != (unsigned long long)(-1))
+    {
+        if (appear[pst] == key) return;
+        if (++pst == appear_size) pst = 0;
+    }
+    appear[pst] = key;
+}
+
+bool line_triple::check_appear(int h, int t, int r)
+{
+    unsigned long long key = triple_key(h, t, r);
+    long long pst = line_hash_slot(line_mix_key(key), appear_size);
+    while (appear[pst] != (unsigned long long)(-1))
+    {
+        if (appear[pst] == key) return true;
+        if (++pst == appear_size) pst = 0;
+    }
+    return false;
+}
+
+void line_triple::init(const char *file_name, line_node *p_h, line_node *p_t, line_node *p_r)
+{
+    strcpy(triple_file, file_name);
+    node_h = p_h;
+    node_t = p_t;
+    node_r = p_r;
+    for (int k = 0; k != 3; k++) kernel[k] = line_kernel_select(k, node_r->vector_size);
+    
+    if ((double)node_h->node_size * node_r->node_size * node_t->node_size >= 1.8e19)
+    {
+        printf("ERROR: too many nodes to index triples!\n");
+        exit(1);
+    }
+    
+    int r;
+    long long *rel_pst = (long long *)calloc(node_r->node_size + 1, sizeof(long long));
+    
+    std::vector<line_load_part> part(line_load_threads);
+    for (int k = 0; k != line_load_threads; k++)
+    {
+        part[k].node[0] = node_h;
+        part[k].node[1] = node_t;
+        part[k].node[2] = node_r;
+    }
+    line_load_file(triple_file, "triple", part, line_load_triple_part);
+    triple_size = 0;
+    for (int k = 0; k != line_load_threads; k++)
+    {
+        triple_size += part[k].id[2].size();
+        for (size_t e = 0; e != part[k].id[2].size(); e++) rel_pst[part[k].id[2][e] + 1] += 1;
+    }
+    for (r = 0; r != node_r->node_size; r++) rel_pst[r + 1] += rel_pst[r];
+    
+    // allocate spaces
+    triple_h = (int *)line_mem_alloc(triple_size * sizeof(int), LINE_MEM_TRIPLE);
+    triple_t = (int *)line_mem_alloc(triple_size * sizeof(int), LINE_MEM_TRIPLE);
+    triple_r = (int *)line_mem_alloc(triple_size * sizeof(int), LINE_MEM_TRIPLE);
+    if (triple_h == NULL || triple_t == NULL || triple_r == NULL)
+    {
+        printf("Error: memory allocation failed!\n");
+        exit(1);
+    }
+    
+    // keep the triple set at most 70% full, about 11.4 bytes per triple
+    if (triple_size > LLONG_MAX / 10 / (long long)sizeof(unsigned long long))
+    {
+        printf("ERROR: too many triples for the triple set!\n");
+        exit(1);
+    }
+    appear_size = triple_size * 10 / 7 + 2;
+    appear = (unsigned long long *)line_mem_alloc(appear_size * sizeof(unsigned long long), LINE_MEM_TRIPLE);
+    if (appear == NULL)
+    {
+        printf("Error: memory allocation failed!\n");
+        exit(1);
+    }
+    memset(appear, 0xFF, appear_size * sizeof(unsigned long long));
+    
+    // read edges, grouped by relation and sorted by (head, tail) within a relation
+    // so that consecutive triples share rows
+    unsigned long long *key = (unsigned long long *)malloc((triple_size > 0 ? triple_size : 1) * sizeof(unsigned long long));
+    long long *rel_fill = (long long *)malloc((node_r->node_size + 1) * sizeof(long long));
+    memcpy(rel_fill, rel_pst, (node_r->node_size + 1) * sizeof(long long));
+    for (int k = 0; k != line_load_threads; k++) for (size_t e = 0; e != part[k].id[2].size(); e++)
+    {
+        int h = part[k].id[0][e], t = part[k].id[1][e];
+        r = part[k].id[2][e];
+        key[rel_fill[r]] = ((unsigned long long)h << 32) | (unsigned int)t;
+        triple_r[rel_fill[r]] = r;
+        rel_fill[r] += 1;
+        
+        add_appear(h, t, r);
+    }
+    for (r = 0; r != node_r->node_size; r++) std::sort(key + rel_pst[r], key + rel_pst[r + 1]);
+    for (long long k = 0; k != triple_size; k++)
+    {
+        triple_h[k] = (int)(key[k] >> 32);
+        triple_t[k] = (int)(key[k] & 0xFFFFFFFF);
+    }
+    free(key);
+    free(rel_fill);
+    free(rel_pst);
+    
+    printf("Reading edges from file: %s, DONE!\n", triple_file);
+    printf("Edge size: %lld\n", triple_size);
+}
+
+void line_triple::save_cache(const char *cache_file)
+{
+    FILE *fo = fopen(cache_file, "wb");
+    if (fo == NULL)
+    {
+        printf("ERROR: cannot write cache file!\n");
+        printf("%s\n", cache_file);
+        exit(1);
+    }
+    
+    line_cache_header header;
+    memset(&header, 0, sizeof(header));
+    memcpy(header.magic, "LINETRP", 8);
+    header.version = LINE_CACHE_VERSION;
+    header.sig[0] = node_h->get_signature();
+    header.sig[1] = node_t->get_signature();
+    header.sig[2] = node_r->get_signature();
+    line_cache_source(triple_file, header.src_size, header.src_mtime);
+    header.size[0] = triple_size;
+    header.size[1] = appear_size;
+    
+    line_cache_write(fo, &header, sizeof(header));
+    line_cache_write(fo, triple_h, triple_size * sizeof(int));
+    line_cache_write(fo, triple_t, triple_size * sizeof(int));
+    line_cache_write(fo, triple_r, triple_size * sizeof(int));
+    line_cache_write(fo, appear, appear_size * sizeof(unsigned long long));
+    fclose(fo);
+    
+    printf("Writing triple cache: %s, DONE!\n", cache_file);
+}
+
+bool line_triple::load_cache(const char *cache_file, const char *file_name, line_node *p_h, line_node *p_t, line_node *p_r)
+{
+    long long size = 0, src_size, src_mtime;
+    char *map = line_cache_map(cache_file, "LINETRP", size);
+    if (map == NULL) return false;
+    
+    line_cache_header *header = (line_cache_header *)map;
+    line_cache_source(file_name, src_size, src_mtime);
+    if (header->sig[0] != p_h->get_signature() || header->sig[1] != p_t->get_signature() || header->sig[2] != p_r->get_signature() || header->src_size != src_size || header->src_mtime != src_mtime)
+    {
+        printf("Triple cache %s is stale, rebuilding.\n", cache_file);
+        munmap(map, size);
+        return false;
+    }
+    
+    strcpy(triple_file, file_name);
+    node_h = p_h;
+    node_t = p_t;
+    node_r = p_r;
+    for (int k = 0; k != 3; k++) kernel[k] = line_kernel_select(k, node_r->vector_size);
+    cache_map = map;
+    cache_size = size;
+    
+    triple_size = header->size[0];
+    appear_size = header->size[1];
+    
+    char *pt = map + line_cache_align(sizeof(line_cache_header));
+    triple_h = (int *)pt;
+    pt += line_cache_align(triple_size * sizeof(int));
+    triple_t = (int *)pt;
+    pt += line_cache_align(triple_size * sizeof(int));
+    triple_r = (int *)pt;
+    pt += line_cache_align(triple_size * sizeof(int));
+    appear = (unsigned long long *)pt;
+    pt += line_cache_align(appear_size * sizeof(unsigned long long));
+    if (pt - map != size)
+    {
+        printf("ERROR: triple cache %s is truncated!\n", cache_file);
+        exit(1);
+    }
+    
+    printf("Reading triples from cache: %s, DONE!\n", cache_file);
+    printf("Edge size: %lld\n", triple_size);
+    return true;
+}
+
+void line_triple::train_ht(real lr, int dis_type, int h, int t, int nh, int nt, real *_h, real *_t, real *_r, real *_nh, real *_nt, real *_error_vec)
+{
+    int vector_size = node_r->vector_size;
+    
+    real inv_h = 1 / node_h->get_norm(h);
+    real inv_t = 1 / node_t->get_norm(t);
+    real inv_nh = 1 / node_h->get_norm(nh);
+    real inv_nt = 1 / node_t->get_norm(nt);
+    
+    kernel[dis_type == 1 || dis_type == 2 ? dis_type : 0]->ht(vector_size, lr, _h, _t, _r, _nh, _nt, inv_h, inv_t, inv_nh, inv_nt, _error_vec);
+    
+    update(node_h, h, _h, _error_vec);
+    update(node_t, t, _t, _error_vec + vector_size);
+    update(node_h, nh, _nh, _error_vec + 2 * vector_size);
+    update(node_t, nt, _nt, _error_vec + 3 * vector_size);
+}
+
+// Apply err through the normalization x / |x|. The Jacobian (|x|^2 I - x^T x) / |x|^3
+// is a rank-1 correction of the identity, so the product costs O(d).
+void line_triple::update(line_node *node, int rowid, real *_row, real *_err)
+{
+    Eigen::Map<BLPVector> err(_err, node->vector_size);
+    Eigen::Map<BLPVector> row(_row, node->vector_size);
+    real len = node->get_norm(rowid);
+    real proj = row.dot(err);
+    row = row * (1 - proj / (len * len * len)) + err / len;
+    node->put_row(rowid, _row);
+}
+
+void line_triple::set_focus(real rate, const char *old_file)
+{
+    int h, t, r;
+    char sh[MAX_STRING], st[MAX_STRING], sr[MAX_STRING];
+    std::vector<unsigned long long> old_key;
+    
+    if (old_file != NULL)
+    {
+        FILE *fi = fopen(old_file, "rb");
+        if (fi == NULL)
+        {
+            printf("ERROR: old triple file not found!\n");
+            printf("%s\n", old_file);
+            exit(1);
+        }
+        while (1)
+        {
+            if (fscanf(fi, "%s %s %s", sh, st, sr) != 3) break;
+            h = node_h->search(sh);
+            t = node_t->search(st);
+            r = node_r->search(sr);
+            if (h == -1 || t == -1 || r == -1) continue;
+            old_key.push_back(triple_key(h, t, r));
+        }
+        fclose(fi);
+        std::sort(old_key.begin(), old_key.end());
+    }
+    
+    // an entity changed if it has no warm-started vector or takes part in a triple
+    // that is not in the old file
+    unsigned char *changed_h = (unsigned char *)calloc(node_h->node_size, 1);
+    unsigned char *changed_t = node_t == node_h ? changed_h : (unsigned char *)calloc(node_t->node_size, 1);
+    for (h = 0; h != node_h->node_size; h++) if (!node_h->is_warm(h)) changed_h[h] = 1;
+    for (t = 0; t != node_t->node_size; t++) if (!node_t->is_warm(t)) changed_t[t] = 1;
+    if (old_file != NULL) for (long long k = 0; k != triple_size; k++)
+    {
+        if (std::binary_search(old_key.begin(), old_key.end(), triple_key(triple_h[k], triple_t[k], triple_r[k]))) continue;
+        changed_h[triple_h[k]] = 1;
+        changed_t[triple_t[k]] = 1;
+    }
+    
+    focus_size = 0;
+    for (long long k = 0; k != triple_size; k++) if (changed_h[triple_h[k]] || changed_t[triple_t[k]]) focus_size++;
+    if (focus_id != NULL) line_mem_free(focus_id);
+    focus_id = (long long *)line_mem_alloc((focus_size > 0 ? focus_size : 1) * sizeof(long long), LINE_MEM_TRIPLE);
+    focus_size = 0;
+    for (long long k = 0; k != triple_size; k++) if (changed_h[triple_h[k]] || changed_t[triple_t[k]]) focus_id[focus_size++] = k;
+    focus_rate = rate;
+    if (changed_t != changed_h) free(changed_t);
+    free(changed_h);
+    
+    printf("Focus triples: %lld of %lld, sampled at rate %f\n", focus_size, triple_size, focus_rate);
+}
+
+void line_triple::set_negative_range(int h_begin, int h_end, int t_begin, int t_end)
+{
+    neg_h_begin = h_begin;
+    neg_h_end = h_end;
+    neg_t_begin = t_begin;
+    neg_t_end = t_end;
+}
+
+long long line_triple::get_triple_size()
+{
+    return triple_size;
+}
+
+long long line_triple::get_neg_skipped()
+{
+    return neg_skipped;
+}
+
+void line_triple::update_relation()
+{
+    int vector_size = node_r->vector_size;
+    real *buf = (real *)malloc(2 * vector_size * sizeof(real));
+    real *sum = (real *)calloc((long long)node_r->node_size * vector_size, sizeof(real));
+    int *cnt = (int *)calloc(node_r->node_size, sizeof(int));
+    for (long long k = 0; k != triple_size; k++)
+    {
+        int h = triple_h[k];
+        int t = triple_t[k];
+        int r = triple_r[k];
+        
+        Eigen::Map<BLPVector> vec_h(node_h->get_row(h, buf), vector_size);
+        Eigen::Map<BLPVector> vec_t(node_t->get_row(t, buf + vector_size), vector_size);
+        Eigen::Map<BLPVector> vec_r(sum + (long long)r * vector_size, vector_size);
+        vec_r += vec_t / node_t->get_norm(t) - vec_h / node_h->get_norm(h);
+        cnt[r] += 1;
+    }
+    for (int r = 0; r != node_r->node_size; r++) if (cnt[r] != 0)
+    {
+        Eigen::Map<BLPVector> vec_r(sum + (long long)r * vector_size, vector_size);
+        vec_r /= cnt[r];
+        node_r->put_row(r, vec_r.data());
+    }
+    free(buf);
+    free(sum);
+    free(cnt);
+}
+
+void line_triple::prefetch(long long triple_id)
 {
-    node_h = NULL;
-    node_t = NULL;
-    node_r = NULL;
-    triple_size = 0;
-    triple_h = NULL;
-    triple_t = NULL;
-    triple_r = NULL;
-    triple_file[0] = 0;
+    node_h->prefetch_row(triple_h[triple_id]);
+    node_t->prefetch_row(triple_t[triple_id]);
+    node_r->prefetch_row(triple_r[triple_id]);
 }
 
-line_triple::~line_triple()
+long long line_triple::draw_triple(line_rng *rng)
 {
-    node_h = NULL;
-    node_t = NULL;
-    node_r = NULL;
-    triple_size = 0;
-    if (triple_h != NULL) {free(triple_h); triple_h = NULL;}
-    if (triple_t != NULL) {free(triple_t); triple_t = NULL;}
-    if (triple_r != NULL) {free(triple_r); triple_r = NULL;}
-    triple_file[0] = 0;
+    if (focus_size > 0 && rng->rand_num() < focus_rate) return focus_id[(long long)(focus_size * rng->rand_num())];
+    return triple_size * rng->rand_num();
 }
 
-void line_triple::init(const char *file_name, line_node *p_h, line_node *p_t, line_node *p_r)
+int line_triple::draw_negative(bool corrupt_head, line_rng *rng)
 {
-    strcpy(triple_file, file_name);
-    node_h = p_h;
-    node_t = p_t;
-    node_r = p_r;
-    
-    triple trip;
-    char sh[MAX_STRING], st[MAX_STRING], sr[MAX_STRING];
-    int h, t, r;
-    
-    // compute the number of edges
-    FILE *fi = fopen(triple_file, "rb");
-    if (fi == NULL)
+    int neg_begin, neg_size;
+    if (corrupt_head)
     {
-        printf("ERROR: triple file not found!\n");
-        printf("%s\n", triple_file);
-        exit(1);
+        neg_begin = neg_h_end > neg_h_begin ? neg_h_begin : 0;
+        neg_size = neg_h_end > neg_h_begin ? neg_h_end - neg_h_begin : node_h->node_size;
     }
-    triple_size = 0;
-    while (1)
+    else
     {
-        if (fscanf(fi, "%s %s %s", sh, st, sr) != 3) break;
-        
-        if (triple_size % 10000 == 0)
-        {
-            printf("%lldK%c", triple_size / 1000, 13);
-            fflush(stdout);
-        }
-        
-        h = node_h->search(sh);
-        t = node_t->search(st);
-        r = node_r->search(sr);
-        
-        if (h == -1 || t == -1 || r == -1) continue;
-        
-        triple_size += 1;
+        neg_begin = neg_t_end > neg_t_begin ? neg_t_begin : 0;
+        neg_size = neg_t_end > neg_t_begin ? neg_t_end - neg_t_begin : node_t->node_size;
     }
-    fclose(fi);
+    return neg_begin + (int)(rng->rand_num() * neg_size);
+}
+
+void line_triple::train_sample(real lr, real margin, int dis_type, real *_error_vec, line_rng *rng, line_prefetch *pf)
+{
+    unsigned long long start = pf != NULL ? line_cycles() : 0;
     
-    // allocate spaces
-    triple_h = (int *)malloc(triple_size * sizeof(int));
-    triple_t = (int *)malloc(triple_size * sizeof(int));
-    triple_r = (int *)malloc(triple_size * sizeof(int));
-    if (triple_h == NULL || triple_t == NULL || triple_r == NULL)
+    if (pf != NULL && pf->distance > 0)
     {
-        printf("Error: memory allocation failed!\n");
-        exit(1);
+        // Queue the triple together with the side to corrupt and a first negative.
+        // The ids of a new entry are only known once its triple is read, so that is
+        // fetched first and the rows and the appear slot half way through the queue.
+        while (pf->size < pf->distance)
+        {
+            long long id = draw_triple(rng);
+            bool corrupt_head = rng->rand_num() < 0.5;
+            int neg = draw_negative(corrupt_head, rng);
+            __builtin_prefetch(triple_h + id);
+            __builtin_prefetch(triple_t + id);
+            __builtin_prefetch(triple_r + id);
+            (corrupt_head ? node_h : node_t)->prefetch_row(neg);
+            pf->issued[LINE_PREFETCH_TRIPLE]++;
+            pf->push(id, corrupt_head, neg);
+        }
+        int k = (pf->head + pf->size / 2) % LINE_PREFETCH_MAX;
+        long long mid = pf->ring_a[k];
+        prefetch(mid);
+        if (pf->ring_b[k]) __builtin_prefetch(appear + line_hash_slot(line_mix_key(triple_key(pf->ring_c[k], triple_t[mid], triple_r[mid])), appear_size));
+        else __builtin_prefetch(appear + line_hash_slot(line_mix_key(triple_key(triple_h[mid], pf->ring_c[k], triple_r[mid])), appear_size));
+        pf->issued[LINE_PREFETCH_TRIPLE] += 3;
+        long long id;
+        int corrupt_head, neg;
+        pf->pop(id, corrupt_head, neg);
+        train_corrupt(id, corrupt_head != 0, neg, lr, margin, dis_type, _error_vec, rng);
     }
+    else train_triple(draw_triple(rng), lr, margin, dis_type, _error_vec, rng);
     
-    // read edges
-    fi = fopen(triple_file, "rb");
-    int cnt = 0;
-    while (1)
+    if (pf != NULL)
     {
-        if (fscanf(fi, "%s %s %s", sh, st, sr) != 3) break;
-        
-        h = node_h->search(sh);
-        t = node_t->search(st);
-        r = node_r->search(sr);
-        
-        if (h == -1 || t == -1 || r == -1) continue;
-        
-        // store edges
-        triple_h[cnt] = h;
-        triple_t[cnt] = t;
-        triple_r[cnt] = r;
-        
-        cnt += 1;
-        
-        trip.h = h;
-        trip.r = r;
-        trip.t = t;
-        
-        appear.insert(trip);
+        pf->samples[LINE_PREFETCH_TRIPLE]++;
+        pf->cycles[LINE_PREFETCH_TRIPLE] += line_cycles() - start;
     }
-    fclose(fi);
-    
-    printf("Reading edges from file: %s, DONE!\n", triple_file);
-    printf("Edge size: %lld\n", triple_size);
 }
 
-void line_triple::train_ht(real lr, int dis_type, int h, int t, int r, int nh, int nt, int nr)
+// TransE distances of the triple and of its corruption in one pass over the rows:
+// sp is the distance of h * ih + r - t * it and sn that of u * iu + r - v * iv,
+// where (u, v) is (n, t) or (h, n). dis_type 1 is L1 and 2 squared L2.
+static void line_transe_score(int dis_type, int d, const real *h, const real *t, const real *r, const real *u, const real *v, real ih, real it, real iu, real iv, real *sp, real *sn)
 {
-    int vector_size = node_r->vector_size;
-    real x = 0;
-    BLPVector err_h, err_t, err_nh, err_nt;
-    
-    err_h.resize(vector_size);
-    err_h.setZero();
-    err_t.resize(vector_size);
-    err_t.setZero();
-    err_nh.resize(vector_size);
-    err_nh.setZero();
-    err_nt.resize(vector_size);
-    err_nt.setZero();
-    
-    real norm_h = node_h->vec.row(h).norm();
-    real norm_t = node_t->vec.row(t).norm();
-    real norm_nh = node_h->vec.row(nh).norm();
-    real norm_nt = node_t->vec.row(nt).norm();
-    
-    for (int c = 0; c != vector_size; c++)
-    {
+    int c = 0;
+    real p, n, acc_p = 0, acc_n = 0;
+#if defined(__AVX512F__)
+    __m512 vp = _mm512_setzero_ps(), vn = _mm512_setzero_ps();
+    __m512 vih = _mm512_set1_ps(ih), vit = _mm512_set1_ps(it), viu = _mm512_set1_ps(iu), viv = _mm512_set1_ps(iv);
+    for (; c < d; c += 16)
+    {
+        __mmask16 m = d - c >= 16 ? (__mmask16)0xFFFF : (__mmask16)((1u << (d - c)) - 1);
+        __m512 vr = _mm512_maskz_loadu_ps(m, r + c);
+        __m512 dp = _mm512_fnmadd_ps(_mm512_maskz_loadu_ps(m, t + c), vit, _mm512_fmadd_ps(_mm512_maskz_loadu_ps(m, h + c), vih, vr));
+        __m512 dn = _mm512_fnmadd_ps(_mm512_maskz_loadu_ps(m, v + c), viv, _mm512_fmadd_ps(_mm512_maskz_loadu_ps(m, u + c), viu, vr));
         if (dis_type == 1)
         {
-            x = 2 * (node_t->vec(t, c) / norm_t - node_h->vec(h, c) / norm_h - node_r->vec(r, c));
-            if (x > 0) x = 1;
-            else x = -1;
+            vp = _mm512_add_ps(vp, _mm512_abs_ps(dp));
+            vn = _mm512_add_ps(vn, _mm512_abs_ps(dn));
         }
-        else if (dis_type == 2)
+        else
         {
-            x = 2 * (node_t->vec(t, c) / norm_t - node_h->vec(h, c) / norm_h - node_r->vec(r, c));
+            vp = _mm512_fmadd_ps(dp, dp, vp);
+            vn = _mm512_fmadd_ps(dn, dn, vn);
         }
-        //node_r->vec(r, c) += lr * x;
-        //node_h->vec(h, c) += lr * x;
-        //node_t->vec(t, c) -= lr * x;
-        
-        err_h(c) += lr * x;
-        err_t(c) -= lr * x;
-        
+    }
+    acc_p = _mm512_reduce_add_ps(vp);
+    acc_n = _mm512_reduce_add_ps(vn);
+#elif defined(__AVX2__)
+    __m256 vp = _mm256_setzero_ps(), vn = _mm256_setzero_ps(), sign = _mm256_set1_ps(-0.0f);
+    __m256 vih = _mm256_set1_ps(ih), vit = _mm256_set1_ps(it), viu = _mm256_set1_ps(iu), viv = _mm256_set1_ps(iv);
+    for (; c + 8 <= d; c += 8)
+    {
+        __m256 vr = _mm256_loadu_ps(r + c);
+        __m256 dp = _mm256_sub_ps(_mm256_add_ps(_mm256_mul_ps(_mm256_loadu_ps(h + c), vih), vr), _mm256_mul_ps(_mm256_loadu_ps(t + c), vit));
+        __m256 dn = _mm256_sub_ps(_mm256_add_ps(_mm256_mul_ps(_mm256_loadu_ps(u + c), viu), vr), _mm256_mul_ps(_mm256_loadu_ps(v + c), viv));
         if (dis_type == 1)
         {
-            x = 2 * (node_t->vec(nt, c) / norm_nt - node_h->vec(nh, c) / norm_nh - node_r->vec(r, c));
-            if (x > 0) x = 1;
-            else x = -1;
+            vp = _mm256_add_ps(vp, _mm256_andnot_ps(sign, dp));
+            vn = _mm256_add_ps(vn, _mm256_andnot_ps(sign, dn));
         }
-        else if (dis_type == 2)
+        else
         {
-            x = 2 * (node_t->vec(nt, c) / norm_nt - node_h->vec(nh, c) / norm_nh - node_r->vec(r, c));
+            vp = _mm256_add_ps(vp, _mm256_mul_ps(dp, dp));
+            vn = _mm256_add_ps(vn, _mm256_mul_ps(dn, dn));
         }
-        //node_r->vec(nr, c) -= lr * x;
-        //node_h->vec(nh, c) -= lr * x;
-        //node_t->vec(nt, c) += lr * x;
-        
-        err_nh(c) -= lr * x;
-        err_nt(c) += lr * x;
     }
-    
-    ///double norm;
-    
-    //norm = node_r->vec.row(r).norm();
-    //if (norm > 1) node_r->vec.row(r) /= norm;
-    //norm = node_h->vec.row(h).norm();
-    //if (norm > 1) node_h->vec.row(h) /= norm;
-    //norm = node_t->vec.row(t).norm();
-    //if (norm > 1) node_t->vec.row(t) /= norm;
-    
-    //norm = node_r->vec.row(nr).norm();
-    //if (norm > 1) node_r->vec.row(nr) /= norm;
-    //norm = node_h->vec.row(nh).norm();
-    //if (norm > 1) node_h->vec.row(nh) /= norm;
-    //norm = node_t->vec.row(nt).norm();
-    //if (norm > 1) node_t->vec.row(nt) /= norm;
-    
-    update(node_h, h, err_h);
-    update(node_t, t, err_t);
-    update(node_h, nh, err_nh);
-    update(node_t, nt, err_nt);
+    real lane_p[8], lane_n[8];
+    _mm256_storeu_ps(lane_p, vp);
+    _mm256_storeu_ps(lane_n, vn);
+    for (int k = 0; k != 8; k++) {acc_p += lane_p[k]; acc_n += lane_n[k];}
+#endif
+    for (; c < d; c++)
+    {
+        p = h[c] * ih + r[c] - t[c] * it;
+        n = u[c] * iu + r[c] - v[c] * iv;
+        if (dis_type == 1) {acc_p += fabs(p); acc_n += fabs(n);}
+        else {acc_p += p * p; acc_n += n * n;}
+    }
+    *sp = dis_type == 1 || dis_type == 2 ? acc_p : 0;
+    *sn = dis_type == 1 || dis_type == 2 ? acc_n : 0;
 }
 
-void line_triple::update(line_node *node, int rowid, BLPVector &err)
+void line_triple::train_triple(long long triple_id, real lr, real margin, int dis_type, real *_error_vec, line_rng *rng)
 {
-    int vector_size = node->vector_size;
-    BLPMatrix trans;
-    trans.resize(vector_size, vector_size);
-    trans = node->vec.row(rowid).transpose() * node->vec.row(rowid);
-    trans = -trans;
-    real len = node->vec.row(rowid) * node->vec.row(rowid).transpose();
-    len = sqrtf(len);
-    for (int c = 0; c != vector_size; c++) trans(c, c) += len * len;
-    trans /= (len * len * len);
-    node->vec.row(rowid) += err * trans;
+    // corrupt the head or the tail with equal probability
+    train_corrupt(triple_id, rng->rand_num() < 0.5, -1, lr, margin, dis_type, _error_vec, rng);
 }
 
-void line_triple::train_sample(real lr, real margin, int dis_type, double (*func_rand_num)())
+void line_triple::train_corrupt(long long triple_id, bool corrupt_head, int neg, real lr, real margin, int dis_type, real *_error_vec, line_rng *rng)
 {
-    int triple_id, h, t, r, neg;
+    int h, t, r, vector_size = node_r->vector_size;
     real sn = 0, sp = 0;
-    triple trip;
-    
-    triple_id = triple_size * func_rand_num();
+    real *buf = _error_vec + 4 * vector_size;
     
     h = triple_h[triple_id];
     t = triple_t[triple_id];
     r = triple_r[triple_id];
     
-    double coin = func_rand_num();
-    if (coin < 0.5)
+    // A row that takes two places (h == t, or a negative equal to the kept entity)
+    // is decoded into one buffer, so that with bf16 storage its second update is
+    // applied on top of the first instead of overwriting it, as with fp32 rows.
+    real *_h = node_h->get_row(h, buf);
+    real *_t = node_t == node_h && t == h ? _h : node_t->get_row(t, buf + vector_size);
+    real *_r = node_r->get_row(r, buf + 2 * vector_size);
+    real inv_h = 1 / node_h->get_norm(h), inv_t = 1 / node_t->get_norm(t);
+    
+    // a narrow negative range (a small partition bucket) may hold nothing but true
+    // corruptions, so the sample is skipped after LINE_NEG_TRIES draws
+    if (neg < 0) neg = draw_negative(corrupt_head, rng);
+    for (int tries = 1; corrupt_head ? check_appear(neg, t, r) : check_appear(h, neg, r); tries++)
     {
-        neg = func_rand_num() * node_h->node_size;
-        trip.h = neg; trip.t = t; trip.r = r;
-        while (appear.count(trip))
-        {
-            neg = func_rand_num() * node_h->node_size;
-            trip.h = neg; trip.t = t; trip.r = r;
-        }
-        
-        if (dis_type == 1)
+        if (tries == LINE_NEG_TRIES)
         {
-            sp = (node_h->vec.row(h)/node_h->vec.row(h).norm() + node_r->vec.row(r) - node_t->vec.row(t)/node_t->vec.row(t).norm()).array().abs().sum();
-            sn = (node_h->vec.row(neg)/node_h->vec.row(neg).norm() + node_r->vec.row(r) - node_t->vec.row(t)/node_t->vec.row(t).norm()).array().abs().sum();
+            __sync_add_and_fetch(&neg_skipped, 1);
+            return;
         }
-        else if (dis_type == 2)
+        neg = draw_negative(corrupt_head, rng);
+    }
+    line_node *node_n = corrupt_head ? node_h : node_t;
+    real *_n;
+    if (node_n == node_h && neg == h) _n = _h;
+    else if (node_n == node_t && neg == t) _n = _t;
+    else _n = node_n->get_row(neg, buf + 3 * vector_size);
+    real inv_n = 1 / node_n->get_norm(neg);
+    
+    if (corrupt_head) line_transe_score(dis_type, vector_size, _h, _t, _r, _n, _t, inv_h, inv_t, inv_n, inv_t, &sp, &sn);
+    else line_transe_score(dis_type, vector_size, _h, _t, _r, _h, _n, inv_h, inv_t, inv_h, inv_n, &sp, &sn);
+    
+    if (sn - sp < margin)
+    {
+        if (corrupt_head) train_ht(lr, dis_type, h, t, neg, t, _h, _t, _r, _n, _t, _error_vec);
+        else train_ht(lr, dis_type, h, t, h, neg, _h, _t, _r, _h, _n, _error_vec);
+    }
+}
+
+line_triple_batch::line_triple_batch()
+{
+    batch_size = 0;
+    pool_size = 0;
+    vector_size = 0;
+    id = NULL;
+    pool = NULL;
+    query = NULL;
+    resid = NULL;
+    err_h = NULL;
+    err_t = NULL;
+    pool_vec = NULL;
+    err_n = NULL;
+    score = NULL;
+    mask = NULL;
+    count = NULL;
+    pool_count = NULL;
+    buf = NULL;
+}
+
+line_triple_batch::~line_triple_batch()
+{
+    if (id != NULL) {free(id); id = NULL;}
+    if (pool != NULL) {free(pool); pool = NULL;}
+    if (query != NULL) {free(query); query = NULL;}
+}
+
+void line_triple_batch::init(int p_batch_size, int p_pool_size, int p_vector_size)
+{
+    batch_size = p_batch_size;
+    pool_size = p_pool_size;
+    vector_size = p_vector_size;
+    if (batch_size < 1 || pool_size < 1)
+    {
+        printf("ERROR: batch and pool sizes must be positive!\n");
+        exit(1);
+    }
+    
+    // one block for all the real arrays
+    long long bd = (long long)batch_size * vector_size, nd = (long long)pool_size * vector_size, bn = (long long)batch_size * pool_size;
+    id = (long long *)malloc(batch_size * sizeof(long long));
+    pool = (int *)malloc(pool_size * sizeof(int));
+    query = (real *)calloc(4 * bd + 2 * nd + 2 * bn + batch_size + pool_size + 3 * vector_size, sizeof(real));
+    resid = query + bd;
+    err_h = resid + bd;
+    err_t = err_h + bd;
+    pool_vec = err_t + bd;
+    err_n = pool_vec + nd;
+    score = err_n + nd;
+    mask = score + bn;
+    count = mask + bn;
+    pool_count = count + batch_size;
+    buf = pool_count + pool_size;
+}
+
+void line_triple::train_batch(line_triple_batch *bt, long long *ids, int cnt, real lr, real margin, int dis_type, line_rng *rng)
+{
+    int B = std::min(cnt, bt->batch_size), N = bt->pool_size, d = node_r->vector_size, b, j, c;
+    int DIS = dis_type == 1 || dis_type == 2 ? dis_type : 0;
+    if (ids == NULL)
+    {
+        for (b = 0; b != B; b++) bt->id[b] = draw_triple(rng);
+        ids = bt->id;
+    }
+    
+    // one side is corrupted for the whole batch, so that the pool comes from one node
+    bool corrupt_head = rng->rand_num() < 0.5;
+    line_node *node_n = corrupt_head ? node_h : node_t;
+    for (j = 0; j != N; j++)
+    {
+        bt->pool[j] = draw_negative(corrupt_head, rng);
+        node_n->prefetch_row(bt->pool[j]);
+    }
+    for (j = 0; j != N; j++)
+    {
+        real *row = node_n->get_row(bt->pool[j], bt->buf), inv = 1 / node_n->get_norm(bt->pool[j]);
+        for (c = 0; c != d; c++) bt->pool_vec[(long long)j * d + c] = row[c] * inv;
+    }
+    
+    // query: the part of the corrupted triple that is kept, as h + r (tail corrupted)
+    // or t - r (head corrupted), so that a negative n scores |query - n|;
+    // resid: h + r - t of the positive triple
+    for (b = 0; b != B; b++)
+    {
+        int h = triple_h[ids[b]], t = triple_t[ids[b]], r = triple_r[ids[b]];
+        real *_h = node_h->get_row(h, bt->buf), *_t = node_t->get_row(t, bt->buf + d), *_r = node_r->get_row(r, bt->buf + 2 * d);
+        real inv_h = 1 / node_h->get_norm(h), inv_t = 1 / node_t->get_norm(t);
+        real *q = bt->query + (long long)b * d, *e = bt->resid + (long long)b * d;
+        for (c = 0; c != d; c++)
         {
-            sp = (node_h->vec.row(h)/node_h->vec.row(h).norm() + node_r->vec.row(r) - node_t->vec.row(t)/node_t->vec.row(t).norm()).array().pow(2).sum();
-            sn = (node_h->vec.row(neg)/node_h->vec.row(neg).norm() + node_r->vec.row(r) - node_t->vec.row(t)/node_t->vec.row(t).norm()).array().pow(2).sum();
+            e[c] = _h[c] * inv_h + _r[c] - _t[c] * inv_t;
+            q[c] = corrupt_head ? _t[c] * inv_t - _r[c] : _h[c] * inv_h + _r[c];
         }
-        
-        if (sn - sp < margin)
+    }
+    
+    Eigen::Map<BLPMatrix> Q(bt->query, B, d), E(bt->resid, B, d), P(bt->pool_vec, N, d);
+    Eigen::Map<BLPMatrix> S(bt->score, B, N), M(bt->mask, B, N);
+    Eigen::Map<BLPMatrix> EH(bt->err_h, B, d), ET(bt->err_t, B, d), EN(bt->err_n, N, d);
+    Eigen::Map<BLPVector> hits(bt->count, B), pool_cnt(bt->pool_count, N);
+    
+    // the distances of all pairs; the pool rows have unit length
+    if (DIS == 2)
+    {
+        S.noalias() = Q * P.transpose();
+        for (b = 0; b != B; b++)
         {
-            train_ht(lr, dis_type, h, t, r, neg, t, r);
+            real qq = Q.row(b).squaredNorm();
+            for (j = 0; j != N; j++) S(b, j) = qq + 1 - 2 * S(b, j);
         }
     }
-    else
+    else if (DIS == 1)
+    {
+        for (b = 0; b != B; b++) for (j = 0; j != N; j++) S(b, j) = (Q.row(b) - P.row(j)).array().abs().sum();
+    }
+    else S.setZero();
+    
+    // The pairs within the margin. As in train_triple, a corruption that is a true
+    // triple is no negative; only the pairs within the margin probe the appear set.
+    for (b = 0; b != B; b++)
     {
-        neg = func_rand_num() * node_t->node_size;
-        trip.h = h; trip.t = neg; trip.r = r;
-        while (appear.count(trip))
+        int h = triple_h[ids[b]], t = triple_t[ids[b]], r = triple_r[ids[b]];
+        real sp = DIS == 1 ? E.row(b).array().abs().sum() : (DIS == 2 ? E.row(b).squaredNorm() : 0);
+        for (j = 0; j != N; j++) M(b, j) = S(b, j) - sp < margin ? 1 : 0;
+        for (j = 0; j != N; j++)
         {
-            neg = func_rand_num() * node_t->node_size;
-            trip.h = h; trip.t = neg; trip.r = r;
+            if (M(b, j) == 0) continue;
+            if (corrupt_head ? check_appear(bt->pool[j], t, r) : check_appear(h, bt->pool[j], r)) M(b, j) = 0;
         }
-        
-        if (dis_type == 1)
+    }
+    hits = M.rowwise().sum().transpose();
+    pool_cnt = M.colwise().sum();
+    
+    // Gradients, as in train_ht with x = 2 * (t - h - r): the positive moves h by
+    // lr * x and t by -lr * x for every pair it is in; a pair moves the kept side
+    // (h or t) and the negative by -+lr * x' of the corrupted triple, with
+    // x' = sign * (query - n), sign being 2 for head and -2 for tail corruption.
+    real scale = lr / N, sign = corrupt_head ? 2 : -2, side = corrupt_head ? 1 : -1;
+    EH.setZero();
+    ET.setZero();
+    EN.setZero();
+    if (DIS == 2)
+    {
+        for (b = 0; b != B; b++)
         {
-            sp = (node_h->vec.row(h)/node_h->vec.row(h).norm() + node_r->vec.row(r) - node_t->vec.row(t)/node_t->vec.row(t).norm()).array().abs().sum();
-            sn = (node_h->vec.row(h)/node_h->vec.row(h).norm() + node_r->vec.row(r) - node_t->vec.row(neg)/node_t->vec.row(neg).norm()).array().abs().sum();
+            EH.row(b) = -2 * scale * hits(b) * E.row(b);
+            ET.row(b) = 2 * scale * hits(b) * E.row(b);
         }
-        else if (dis_type == 2)
+        // sum over the pairs of (query - n) for each triple and for each negative
+        Eigen::Map<BLPMatrix> KS(corrupt_head ? bt->err_t : bt->err_h, B, d);
+        KS.noalias() += side * scale * sign * (hits.asDiagonal() * Q - M * P);
+        EN.noalias() = -side * scale * sign * (M.transpose() * Q - pool_cnt.asDiagonal() * P);
+    }
+    else if (DIS == 1)
+    {
+        for (b = 0; b != B; b++)
         {
-            sp = (node_h->vec.row(h)/node_h->vec.row(h).norm() + node_r->vec.row(r) - node_t->vec.row(t)/node_t->vec.row(t).norm()).array().pow(2).sum();
-            sn = (node_h->vec.row(h)/node_h->vec.row(h).norm() + node_r->vec.row(r) - node_t->vec.row(neg)/node_t->vec.row(neg).norm()).array().pow(2).sum();
+            real *kept = corrupt_head ? bt->err_t + (long long)b * d : bt->err_h + (long long)b * d;
+            for (c = 0; c != d; c++)
+            {
+                real x = -2 * E(b, c) > 0 ? 1 : -1;
+                EH(b, c) += scale * hits(b) * x;
+                ET(b, c) -= scale * hits(b) * x;
+            }
+            for (j = 0; j != N; j++)
+            {
+                if (M(b, j) == 0) continue;
+                real *en = bt->err_n + (long long)j * d;
+                for (c = 0; c != d; c++)
+                {
+                    real x = sign * (Q(b, c) - P(j, c)) > 0 ? 1 : -1;
+                    kept[c] += side * scale * x;
+                    en[c] -= side * scale * x;
+                }
+            }
         }
-        
-        if (sn - sp < margin)
+    }
+    
+    // apply everything in one pass
+    for (b = 0; b != B; b++)
+    {
+        if (hits(b) == 0) continue;
+        int h = triple_h[ids[b]], t = triple_t[ids[b]];
+        update(node_h, h, node_h->get_row(h, bt->buf), bt->err_h + (long long)b * d);
+        update(node_t, t, node_t->get_row(t, bt->buf), bt->err_t + (long long)b * d);
+    }
+    for (j = 0; j != N; j++)
+    {
+        if (pool_cnt(j) == 0) continue;
+        update(node_n, bt->pool[j], node_n->get_row(bt->pool[j], bt->buf), bt->err_n + (long long)j * d);
+    }
+}
+
+line_triple_walker::line_triple_walker()
+{
+    trip = NULL;
+    index = NULL;
+    first = 0;
+    last = 0;
+    chunk_list = NULL;
+    chunk_cnt = 0;
+    chunk_size = 0;
+    chunk_pos = 0;
+    pos = 0;
+    end = 0;
+    prefetch_ahead = 0;
+}
+
+line_triple_walker::~line_triple_walker()
+{
+    trip = NULL;
+    if (chunk_list != NULL) {free(chunk_list); chunk_list = NULL;}
+    chunk_cnt = 0;
+}
+
+void line_triple_walker::init(line_triple *p_trip, int id, int num_threads, long long chunk, int ahead)
+{
+    init(p_trip, NULL, 0, p_trip->triple_size, id, num_threads, chunk, ahead);
+}
+
+void line_triple_walker::init(line_triple *p_trip, long long *p_index, long long p_begin, long long p_end, int id, int num_threads, long long chunk, int ahead)
+{
+    trip = p_trip;
+    index = p_index;
+    first = p_begin;
+    last = p_end;
+    chunk_size = chunk;
+    prefetch_ahead = ahead;
+    
+    long long total = (last - first + chunk_size - 1) / chunk_size;
+    chunk_cnt = 0;
+    if (chunk_list != NULL) free(chunk_list);
+    chunk_list = (long long *)malloc((total / num_threads + 1) * sizeof(long long));
+    for (long long k = id; k < total; k += num_threads) chunk_list[chunk_cnt++] = k;
+    chunk_pos = chunk_cnt;
+    pos = 0;
+    end = 0;
+}
+
+long long line_triple_walker::get_size()
+{
+    long long size = 0;
+    for (long long k = 0; k != chunk_cnt; k++)
+        size += std::min((chunk_list[k] + 1) * chunk_size, last - first) - chunk_list[k] * chunk_size;
+    return size;
+}
+
+long long line_triple_walker::next(line_rng *rng)
+{
+    if (pos == end)
+    {
+        if (chunk_pos == chunk_cnt)
         {
-            train_ht(lr, dis_type, h, t, r, h, neg, r);
+            // a new epoch: shuffle the order of the chunks
+            for (long long k = chunk_cnt - 1; k > 0; k--)
+                std::swap(chunk_list[k], chunk_list[rng->rand_int() % (k + 1)]);
+            chunk_pos = 0;
         }
+        pos = first + chunk_list[chunk_pos++] * chunk_size;
+        end = std::min(pos + chunk_size, last);
+        for (long long k = pos; k < pos + prefetch_ahead && k < end; k++) trip->prefetch(index != NULL ? index[k] : k);
     }
+    if (pos + prefetch_ahead < end) trip->prefetch(index != NULL ? index[pos + prefetch_ahead] : pos + prefetch_ahead);
+    pos++;
+    return index != NULL ? index[pos - 1] : pos - 1;
 }
 
-void line_triple::update_relation()
+line_partition::line_partition()
 {
-    node_r->vec.setZero();
-    int *cnt = (int *)calloc(node_r->node_size, sizeof(int));
-    for (long long k = 0; k != triple_size; k++)
+    trip = NULL;
+    node = NULL;
+    parts = 0;
+    bucket_size = 0;
+    block_pst = NULL;
+    block_id = NULL;
+    block_list = NULL;
+    block_cnt = 0;
+    next_block = 0;
+    resident = NULL;
+    started = false;
+}
+
+line_partition::~line_partition()
+{
+    finish();
+    trip = NULL;
+    node = NULL;
+    if (block_pst != NULL) {free(block_pst); block_pst = NULL;}
+    if (block_id != NULL) {line_mem_free(block_id); block_id = NULL;}
+    if (block_list != NULL) {free(block_list); block_list = NULL;}
+    if (resident != NULL) {free(resident); resident = NULL;}
+}
+
+void line_partition::init(line_triple *p_trip, int p_parts)
+{
+    trip = p_trip;
+    node = trip->node_h;
+    parts = p_parts;
+    if (trip->node_t != node || parts < 1)
     {
-        int h = triple_h[k];
-        int t = triple_t[k];
-        int r = triple_r[k];
-        
-        node_r->vec.row(r) += node_t->vec.row(t) / node_t->vec.row(t).norm() - node_h->vec.row(h) / node_h->vec.row(h).norm();
-        cnt[r] += 1;
+        printf("ERROR: partitions need one entity node for heads and tails!\n");
+        exit(1);
     }
-    for (int r = 0; r != node_r->node_size; r++) if (cnt[r] != 0)
-        node_r->vec.row(r) /= cnt[r];
+    
+    // buckets start on page boundaries so that they can be dropped one by one
+    long long page = sysconf(_SC_PAGESIZE), row_bytes = (long long)node->vector_size * (node->storage == LINE_STORAGE_BF16 ? sizeof(unsigned short) : sizeof(real));
+    long long a = page, b = row_bytes, c;
+    while (b != 0) {c = a % b; a = b; b = c;}
+    long long align = page / a;
+    bucket_size = (int)(((node->node_size + parts - 1) / parts + align - 1) / align * align);
+    if (bucket_size < 1) bucket_size = 1;
+    
+    // counting sort of the triples by block, keeping their order within a block
+    long long size = trip->triple_size, k;
+    int blocks = parts * parts, bh, bt;
+    block_pst = (long long *)calloc(blocks + 1, sizeof(long long));
+    for (k = 0; k != size; k++) block_pst[(trip->triple_h[k] / bucket_size) * parts + trip->triple_t[k] / bucket_size + 1]++;
+    for (int i = 0; i != blocks; i++) block_pst[i + 1] += block_pst[i];
+    long long *fill = (long long *)malloc(blocks * sizeof(long long));
+    memcpy(fill, block_pst, blocks * sizeof(long long));
+    block_id = (long long *)line_mem_alloc((size > 0 ? size : 1) * sizeof(long long), LINE_MEM_TRIPLE);
+    for (k = 0; k != size; k++) block_id[fill[(trip->triple_h[k] / bucket_size) * parts + trip->triple_t[k] / bucket_size]++] = k;
+    free(fill);
+    
+    // rows of head buckets, the tail bucket going back and forth
+    block_list = (int *)malloc(blocks * sizeof(int));
+    block_cnt = 0;
+    for (bh = 0; bh != parts; bh++) for (int j = 0; j != parts; j++)
+    {
+        bt = bh % 2 == 0 ? j : parts - 1 - j;
+        if (block_pst[bh * parts + bt + 1] > block_pst[bh * parts + bt]) block_list[block_cnt++] = bh * parts + bt;
+    }
+    
+    // nothing is resident yet: the first block loads (and fills) its buckets
+    resident = (char *)malloc(parts);
+    for (int i = 0; i != parts; i++) resident[i] = 0;
+    next_block = -1;
+    
+    printf("Partitions: %d buckets of %d entities, %d non-empty blocks\n", parts, bucket_size, block_cnt);
+}
+
+int line_partition::get_block_cnt()
+{
+    return block_cnt;
+}
+
+void line_partition::bucket_bytes(int b, long long *offset, long long *size)
+{
+    long long row_bytes = (long long)node->vector_size * (node->storage == LINE_STORAGE_BF16 ? sizeof(unsigned short) : sizeof(real));
+    long long begin = std::min((long long)b * bucket_size, (long long)node->node_size);
+    long long end = std::min((long long)(b + 1) * bucket_size, (long long)node->node_size);
+    *offset = begin * row_bytes;
+    *size = (end - begin) * row_bytes;
+}
+
+void line_partition::evict_bucket(int b)
+{
+    long long offset, size;
+    bucket_bytes(b, &offset, &size);
+    resident[b] = 0;
+    if (node->table_fd == -1 || size == 0) return;
+    char *base = node->storage == LINE_STORAGE_BF16 ? (char *)node->_hvec : (char *)node->_vec;
+    msync(base + offset, size, MS_SYNC);
+    madvise(base + offset, size, MADV_DONTNEED);
+    posix_fadvise(node->table_fd, offset, size, POSIX_FADV_DONTNEED);
+}
+
+void line_partition::load_bucket(int b)
+{
+    long long offset, size, page = sysconf(_SC_PAGESIZE);
+    bucket_bytes(b, &offset, &size);
+    resident[b] = 1;
+    if (node->table_fd == -1 || size == 0) return;
+    char *base = node->storage == LINE_STORAGE_BF16 ? (char *)node->_hvec : (char *)node->_vec;
+    madvise(base + offset, size, MADV_WILLNEED);
+    node->fill_rows(std::min(b * bucket_size, node->node_size), std::min((b + 1) * bucket_size, node->node_size));
+    volatile char sum = 0;
+    for (long long k = 0; k < size; k += page) sum += base[offset + k];
+}
+
+void *line_partition::load_thread(void *arg)
+{
+    line_partition *p = (line_partition *)arg;
+    int cur = p->block_list[(p->next_block + p->block_cnt - 1) % p->block_cnt], nxt = p->block_list[p->next_block];
+    for (int b = 0; b != p->parts; b++)
+    {
+        bool need = b == cur / p->parts || b == cur % p->parts || b == nxt / p->parts || b == nxt % p->parts;
+        if (!need && p->resident[b]) p->evict_bucket(b);
+    }
+    if (!p->resident[nxt / p->parts]) p->load_bucket(nxt / p->parts);
+    if (!p->resident[nxt % p->parts]) p->load_bucket(nxt % p->parts);
+    return NULL;
+}
+
+long long *line_partition::begin_block(int k, long long *begin, long long *end)
+{
+    if (started) {pthread_join(thread, NULL); started = false;}
+    
+    int blk = block_list[k], bh = blk / parts, bt = blk % parts;
+    if (!resident[bh]) load_bucket(bh);
+    if (!resident[bt]) load_bucket(bt);
+    
+    trip->set_negative_range(bh * bucket_size, std::min((bh + 1) * bucket_size, node->node_size), bt * bucket_size, std::min((bt + 1) * bucket_size, node->node_size));
+    *begin = block_pst[blk];
+    *end = block_pst[blk + 1];
+    
+    next_block = (k + 1) % block_cnt;
+    started = pthread_create(&thread, NULL, load_thread, (void *)this) == 0;
+    if (!started) load_thread((void *)this);
+    return block_id;
 }
 
+void line_partition::finish()
+{
+    if (started) {pthread_join(thread, NULL); started = false;}
+    if (trip != NULL) trip->set_negative_range(0, 0, 0, 0);
+    // entities in no triple were never loaded, but are written out all the same
+    if (node != NULL) node->fill_rows(0, node->node_size);
+    if (node != NULL && node->table_fd != -1 && node->table_bytes > 0)
+        msync(node->storage == LINE_STORAGE_BF16 ? (void *)node->_hvec : (void *)node->_vec, node->table_bytes, MS_SYNC);
+}
 
 line_regularizer_line::line_regularizer_line()
 {
@@ -1334,6 +3404,11 @@ line_regularizer_line::~line_regularizer_line()
 void line_regularizer_line::init(line_node *p_node)
 {
     node = p_node;
+    if (node->storage != LINE_STORAGE_FP32)
+    {
+        printf("ERROR: regularizers need fp32 node storage!\n");
+        exit(1);
+    }
     
     expTable = (real *)malloc((EXP_TABLE_SIZE + 1) * sizeof(real));
     for (int i = 0; i < EXP_TABLE_SIZE; i++) {
@@ -1342,10 +3417,10 @@ void line_regularizer_line::init(line_node *p_node)
     }
 }
 
-void line_regularizer_line::train_uv(real lr, int u, int v, int neg_samples, real *_error_vec, double (*func_rand_num)())
+void line_regularizer_line::train_uv(real lr, int u, int v, int neg_samples, real *_error_vec, line_rng *rng, line_prefetch *pf)
 {
     int vector_size = node->vector_size;
-    int target, label;
+    int target, label, unused;
     real f, g;
     Eigen::Map<BLPVector> error_vec(_error_vec, vector_size);
     error_vec.setZero();
@@ -1357,9 +3432,24 @@ void line_regularizer_line::train_uv(real lr, int u, int v, int neg_samples, rea
             target = v;
             label = 1;
         }
+        else if (pf != NULL && pf->distance > 0)
+        {
+            // negatives do not depend on the edge, so distance of them are kept in flight
+            while (pf->size < pf->distance)
+            {
+                int n = rng->rand_num() * node->node_size;
+                node->prefetch_row(n);
+                pf->issued[LINE_PREFETCH_REG_LINE]++;
+                pf->push(n, 0, 0);
+            }
+            long long a;
+            pf->pop(a, unused, unused);
+            target = (int)a;
+            label = 0;
+        }
         else
         {
-            target = func_rand_num() * node->node_size;
+            target = rng->rand_num() * node->node_size;
             label = 0;
         }
         f = node->vec.row(u) * node->vec.row(target).transpose();
@@ -1368,23 +3458,26 @@ void line_regularizer_line::train_uv(real lr, int u, int v, int neg_samples, rea
         else g = (label - expTable[(int)((f + MAX_EXP) * (EXP_TABLE_SIZE / MAX_EXP / 2))]) * lr;
         error_vec += g * ((node->vec.row(target)));
         node->vec.row(target) += g * ((node->vec.row(u)));
+        node->update_norm(target);
     }
     node->vec.row(u) += error_vec;
+    node->update_norm(u);
     new (&error_vec) Eigen::Map<BLPMatrix>(NULL, 0, 0);
 }
 
-void line_regularizer_line::train_sample(real lr, int neg_samples, real *_error_vec, double (*func_rand_num)(), int depth, line_adjacency *p_adjacency)
+void line_regularizer_line::train_sample(real lr, int neg_samples, real *_error_vec, line_rng *rng, int depth, line_adjacency *p_adjacency, line_prefetch *pf)
 {
     int u, v;
     std::vector<int> node_lst;
+    unsigned long long start = pf != NULL ? line_cycles() : 0;
     
     node_lst.clear();
     
-    u = p_adjacency->sample_head(func_rand_num);
+    u = p_adjacency->sample_head(rng);
     v = u;
     for (int k = 0; k != depth; k++)
     {
-        v = p_adjacency->sample(v, func_rand_num);
+        v = p_adjacency->sample(v, rng);
         node_lst.push_back(v);
     }
     
@@ -1393,7 +3486,13 @@ void line_regularizer_line::train_sample(real lr, int neg_samples, real *_error_
         v = node_lst[k];
         if (v == -1) continue;
         
-        train_uv(lr, u, v, neg_samples, _error_vec, func_rand_num);
+        train_uv(lr, u, v, neg_samples, _error_vec, rng, pf);
+    }
+    
+    if (pf != NULL)
+    {
+        pf->samples[LINE_PREFETCH_REG_LINE]++;
+        pf->cycles[LINE_PREFETCH_REG_LINE] += line_cycles() - start;
     }
 }
 
@@ -1401,6 +3500,7 @@ void line_regularizer_line::train_sample(real lr, int neg_samples, real *_error_
 line_regularizer_norm::line_regularizer_norm()
 {
     node = NULL;
+    for (int k = 0; k != 3; k++) kernel[k] = NULL;
 }
 
 line_regularizer_norm::~line_regularizer_norm()
@@ -1411,78 +3511,43 @@ line_regularizer_norm::~line_regularizer_norm()
 void line_regularizer_norm::init(line_node *p_node)
 {
     node = p_node;
+    if (node->storage != LINE_STORAGE_FP32)
+    {
+        printf("ERROR: regularizers need fp32 node storage!\n");
+        exit(1);
+    }
+    for (int k = 0; k != 3; k++) kernel[k] = line_kernel_select(k, node->vector_size);
 }
 
 void line_regularizer_norm::train_uv(real lr, int dis_type, int u, int v)
 {
     int vector_size = node->vector_size;
-    real x = 0;
-    
-    for (int c = 0; c != vector_size; c++)
-    {
-        if (dis_type == 1)
-        {
-            x = 2 * (node->vec(u, c) - node->vec(v, c));
-            if (x > 0) x = 1;
-            else x = -1;
-        }
-        else if (dis_type == 2)
-        {
-            x = 2 * (node->vec(u, c) - node->vec(v, c));
-        }
-        node->vec(u, c) -= lr * x;
-        node->vec(v, c) += lr * x;
-    }
+    kernel[dis_type == 1 || dis_type == 2 ? dis_type : 0]->pair(vector_size, lr, node->_vec + (long long)u * vector_size, node->_vec + (long long)v * vector_size);
+    node->update_norm(u);
+    node->update_norm(v);
 }
 
 void line_regularizer_norm::train_uv_neg(real lr, int dis_type, int u, int v, int n)
 {
     int vector_size = node->vector_size;
-    real x = 0, y = 0;
-    
-    for (int c = 0; c != vector_size; c++)
-    {
-        if (dis_type == 1)
-        {
-            x = 2 * (node->vec(v, c) - node->vec(u, c));
-            if (x > 0) x = 1;
-            else x = -1;
-        }
-        else if (dis_type == 2)
-        {
-            x = 2 * (node->vec(v, c) - node->vec(u, c));
-        }
-        node->vec(v, c) -= lr * x;
-        
-        
-        if (dis_type == 1)
-        {
-            y = 2 * (node->vec(n, c) - node->vec(u, c));
-            if (y > 0) y = 1;
-            else y = -1;
-        }
-        else if (dis_type == 2)
-        {
-            y = 2 * (node->vec(n, c) - node->vec(u, c));
-        }
-        node->vec(n, c) += lr * y;
-        
-        node->vec(u, c) += lr * (x - y);
-    }
+    kernel[dis_type == 1 || dis_type == 2 ? dis_type : 0]->pair_neg(vector_size, lr, node->_vec + (long long)u * vector_size, node->_vec + (long long)v * vector_size, node->_vec + (long long)n * vector_size);
+    node->update_norm(u);
+    node->update_norm(v);
+    node->update_norm(n);
 }
 
-void line_regularizer_norm::train_sample(real lr, int dis_type, double (*func_rand_num)(), int depth, line_adjacency *p_adjacency)
+void line_regularizer_norm::train_sample(real lr, int dis_type, line_rng *rng, int depth, line_adjacency *p_adjacency)
 {
     int u, v;
     std::vector<int> node_lst;
     
     node_lst.clear();
     
-    u = p_adjacency->sample_head(func_rand_num);
+    u = p_adjacency->sample_head(rng);
     v = u;
     for (int k = 0; k != depth; k++)
     {
-        v = p_adjacency->sample(v, func_rand_num);
+        v = p_adjacency->sample(v, rng);
         node_lst.push_back(v);
     }
     
@@ -1495,7 +3560,7 @@ void line_regularizer_norm::train_sample(real lr, int dis_type, double (*func_ra
     }
 }
 
-void line_regularizer_norm::train_sample_neg(real lr, real margin, int dis_type, double (*func_rand_num)(), int depth, line_adjacency *p_adjacency)
+void line_regularizer_norm::train_sample_neg(real lr, real margin, int dis_type, line_rng *rng, int depth, line_adjacency *p_adjacency)
 {
     int u, v, neg;
     real sn = 0, sp = 0;
@@ -1503,11 +3568,11 @@ void line_regularizer_norm::train_sample_neg(real lr, real margin, int dis_type,
     
     node_lst.clear();
     
-    u = p_adjacency->sample_head(func_rand_num);
+    u = p_adjacency->sample_head(rng);
     v = u;
     for (int k = 0; k != depth; k++)
     {
-        v = p_adjacency->sample(v, func_rand_num);
+        v = p_adjacency->sample(v, rng);
         node_lst.push_back(v);
     }
     
@@ -1516,7 +3581,7 @@ void line_regularizer_norm::train_sample_neg(real lr, real margin, int dis_type,
         v = node_lst[k];
         if (v == -1) continue;
         
-        neg = func_rand_num() * node->node_size;
+        neg = rng->rand_num() * node->node_size;
         
         if (dis_type == 1)
         {
@@ -2,6 +2,7 @@
 #include <stdlib.h>
 #include <string.h>
 #include <math.h>
+#include <limits.h>
 #include <algorithm>
 #include <vector>
 #include <map>
@@ -10,12 +11,61 @@
 #include <Eigen/Dense>
 #include "ransampl.h"
 #include <iostream>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/syscall.h>
+#include <pthread.h>
+#if defined(__AVX2__) || defined(__AVX512F__)
+#include <immintrin.h>
+#endif
+#if defined(__x86_64__) || defined(__i386__)
+#include <x86intrin.h>
+#endif
 
 #define MAX_STRING 500
 #define EXP_TABLE_SIZE 1000
 #define MAX_EXP 6
-const int neg_table_size = 1e8;
-const int hash_table_size = 30000000;
+#define LINE_CACHE_VERSION 3
+#define LINE_CHECKPOINT_VERSION 1
+#define LINE_CHECKPOINT_MAX 8
+
+#define LINE_STORAGE_FP32 0
+#define LINE_STORAGE_BF16 1
+
+#define LINE_ORDER_NONE 0
+#define LINE_ORDER_DEGREE 1
+#define LINE_ORDER_BFS 2
+
+#define LINE_MEM_VECTOR 0
+#define LINE_MEM_GRAPH 1
+#define LINE_MEM_SAMPLER 2
+#define LINE_MEM_WEIGHT 3
+#define LINE_MEM_TRIPLE 4
+#define LINE_MEM_COMPONENTS 5
+
+#define LINE_HUGEPAGE_OFF 0
+#define LINE_HUGEPAGE_THP 1
+#define LINE_HUGEPAGE_EXPLICIT 2
+#define LINE_HUGEPAGE_SIZE (2LL << 20)
+
+#define LINE_NUMA_MAX 64
+
+// targets (the positive and negatives) line_trainer_line gathers at a time; with
+// the error and the row of u a batch fills the usual 8 * vector_size scratch
+#define LINE_NEG_BATCH 6
+#define LINE_NEG_TRIES 64
+
+#define LINE_PREFETCH_MAX 64
+#define LINE_PREFETCH_LINE 0
+#define LINE_PREFETCH_REG_LINE 1
+#define LINE_PREFETCH_TRIPLE 2
+#define LINE_PREFETCH_KERNELS 3
+
+#define LINE_SCHEDULER_FLUSH 1000
+#define LINE_SCHEDULER_TICK 10
+#define LINE_SCHEDULER_REPORT 10
 
 typedef float real;
 
@@ -27,81 +77,454 @@ typedef Eigen::Matrix< real, 1, Eigen::Dynamic,
 Eigen::RowMajor | Eigen::AutoAlign >
 BLPVector;
 
-struct struct_node {
-    char *word;
+// Header of the binary dataset caches written by line_hin and line_triple.
+// The arrays that follow are each padded to 64 bytes so they can be used in place
+// after mmap. A cache is only accepted if the version, the vocabularies and the
+// size/mtime of the text file it was compiled from all match.
+struct line_cache_header
+{
+    char magic[8];
+    int version;
+    int flag;
+    unsigned long long sig[3];
+    long long src_size, src_mtime;
+    long long size[4];
 };
 
-struct hin_nb {
-    int nb_id;
-    double eg_wei;
-    char eg_tp;
-};
+// Allocator for the embedding tables, the graph arrays, the samplers and the
+// triples. Blocks of at least LINE_HUGEPAGE_SIZE get their own 2 MB aligned
+// mapping so that they can be backed by huge pages (madvise for THP, or
+// MAP_HUGETLB with THP as fallback) and optionally interleaved over NUMA
+// nodes; smaller blocks come from malloc. All memory is zeroed, and every
+// block is charged to one of the LINE_MEM_* components.
+void line_mem_config(int hugepage, bool interleave);
+void *line_mem_alloc(long long size, int component);
+void line_mem_free(void *ptr);
+void line_mem_report();
+
+// NUMA topology as listed in /sys/devices/system/node; a machine without it is
+// one node holding every cpu. line_numa_bind pins the calling training thread
+// to the cpus of its node (thread id of num_threads goes to node
+// id * nodes / num_threads, so the threads are spread evenly) and returns the
+// node. Threads add their samples with line_numa_count, and line_numa_report
+// prints the throughput of each node over the given wall time.
+int line_numa_init();
+int line_numa_nodes();
+int line_numa_bind(int id, int num_threads);
+void line_numa_count(int node, long long samples);
+void line_numa_report(double seconds);
+
+// Number of threads that parse the triple and network files.
+void line_load_config(int num_threads);
 
-struct triple
+// Header of a checkpoint written by line_node::save_checkpoint. It is followed,
+// each part starting on a 4 KB page, by node_size + 1 offsets into the name
+// block, the '\0'-terminated names, and the rows in vocabulary order, stored
+// as fp32 or bf16 according to storage.
+struct line_checkpoint_header
 {
-    int h, r, t;
-    friend bool operator < (triple t1, triple t2)
-    {
-        if (t1.h == t2.h)
-        {
-            if (t1.r == t2.r) return t1.t < t2.t;
-            return t1.r < t2.r;
-        }
-        return t1.h < t2.h;
-    }
+    char magic[8];
+    int version;
+    int storage;
+    long long node_size, vector_size;
+    long long step;
+    long long pst_offset, name_offset, name_size, vec_offset;
 };
 
+class line_rng;
+class line_vocab;
 class line_node;
+class line_checkpoint;
+class line_scheduler;
+class line_order;
 class line_hin;
 class line_adjacency;
 class line_trainer_line;
 class line_trainer_norm;
 class line_trainer_reg;
 class line_triple;
+class line_triple_walker;
+class line_partition;
 class line_regularizer_norm;
 class line_regularizer_line;
+class line_prefetch;
+class line_triple_batch;
+
+// The per-dimension loops of the margin trainers, instantiated for each distance
+// (0 none, 1 L1, 2 squared L2) and for the common dimensions 50, 100, 128, 200
+// and 256, with a generic instance for the others. A trainer looks its set up
+// once in init with line_kernel_select.
+struct line_kernel_set;
+const line_kernel_set *line_kernel_select(int dis_type, int vector_size);
+
+// A small xorshift128+ generator. Each training thread owns one, so sampling
+// never touches state shared with other threads.
+class line_rng
+{
+protected:
+    unsigned long long s0, s1;
+public:
+    line_rng();
+    
+    void seed(unsigned long long sd);
+    
+    unsigned long long rand_int()
+    {
+        unsigned long long x = s0, y = s1;
+        s0 = y;
+        x ^= x << 23;
+        s1 = x ^ y ^ (x >> 17) ^ (y >> 26);
+        return s1 + y;
+    }
+    
+    // uniform number in [0, 1)
+    double rand_num()
+    {
+        return (rand_int() >> 11) * (1.0 / 9007199254740992.0);
+    }
+};
+
+// time stamp counter, or nanoseconds where there is none
+static inline unsigned long long line_cycles()
+{
+#if defined(__x86_64__) || defined(__i386__)
+    return __rdtsc();
+#else
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (unsigned long long)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+#endif
+}
+
+// Samples drawn ahead of use by one training thread. A trainer keeps distance
+// samples queued whose rows have been prefetched, and trains the oldest, so the
+// rows arrive while the samples in between are computed; distance 0 draws each
+// sample right before it is used. The samples and cycles of each LINE_PREFETCH_*
+// kernel are counted too: the cycles per sample of a run with distance 0 against
+// one with prefetching show how much of a kernel was spent waiting for memory.
+class line_prefetch
+{
+protected:
+    int distance, head, size;
+    long long ring_a[LINE_PREFETCH_MAX];
+    int ring_b[LINE_PREFETCH_MAX], ring_c[LINE_PREFETCH_MAX];
+    long long samples[LINE_PREFETCH_KERNELS], cycles[LINE_PREFETCH_KERNELS], issued[LINE_PREFETCH_KERNELS];
+    
+    void push(long long a, int b, int c)
+    {
+        int k = (head + size++) % LINE_PREFETCH_MAX;
+        ring_a[k] = a;
+        ring_b[k] = b;
+        ring_c[k] = c;
+    }
+    void pop(long long &a, int &b, int &c)
+    {
+        a = ring_a[head];
+        b = ring_b[head];
+        c = ring_c[head];
+        head = (head + 1) % LINE_PREFETCH_MAX;
+        size--;
+    }
+public:
+    line_prefetch();
+    
+    friend class line_trainer_line;
+    friend class line_regularizer_line;
+    friend class line_triple;
+    
+    void init(int p_distance);
+    // add the counters of this thread to the totals printed by line_prefetch_report
+    void merge();
+};
+
+void line_prefetch_report();
+
+// Name <-> id table. All names live in one character arena, and the hash
+// table grows with the vocabulary instead of being allocated at a fixed size.
+class line_vocab
+{
+protected:
+    char *names;
+    long long names_size, names_max_size;
+    long long *name_pst;
+    int vocab_size, vocab_max_size;
+    int *vocab_hash;
+    long long hash_size;
+    
+    unsigned long long get_hash(const char *word);
+    void rehash(long long new_hash_size);
+public:
+    line_vocab();
+    ~line_vocab();
+    
+    void init(const char *file_name);
+    int add(const char *word);
+    int search(const char *word);
+    const char *get_name(int id) { return names + name_pst[id]; }
+    int size() { return vocab_size; }
+    unsigned long long get_signature();
+};
+
+// bf16 keeps the upper half of a float; rounding is to nearest even.
+static inline real line_bf16_to_real(unsigned short h)
+{
+    unsigned int x = (unsigned int)h << 16;
+    real f;
+    memcpy(&f, &x, sizeof(real));
+    return f;
+}
+
+static inline unsigned short line_real_to_bf16(real f)
+{
+    unsigned int x;
+    memcpy(&x, &f, sizeof(real));
+    if ((x & 0x7fffffff) > 0x7f800000) return (unsigned short)((x >> 16) | 0x40);
+    x += 0x7fff + ((x >> 16) & 1);
+    return (unsigned short)(x >> 16);
+}
 
 class line_node
 {
 protected:
-    struct struct_node *node;
-    int node_size, node_max_size, vector_size;
+    line_vocab *vocab;
+    bool vocab_owner;
+    int node_size, vector_size;
     char node_file[MAX_STRING];
-    int *node_hash;
+    // With LINE_STORAGE_FP32 the rows live in _vec and vec maps them. With
+    // LINE_STORAGE_BF16 they live in _hvec, vec is empty, and rows must be
+    // accessed through get_row/put_row.
+    int storage;
     real *_vec;
+    unsigned short *_hvec;
+    real *_norm;
     Eigen::Map<BLPMatrix> vec;
-    
-    int get_hash(char *word);
-    int add_node(char *word);
+    // row of each vocabulary id after reorder; NULL while rows follow the vocabulary
+    int *order;
+    // per row, 1 if its vector came from the warm start file; NULL without warm start
+    unsigned char *warm;
+    // with a table file the rows are a shared mapping of that file instead of memory,
+    // and filled[id] tells whether row id has been initialized (see fill_rows)
+    int table_fd;
+    long long table_bytes;
+    unsigned char *filled;
+    
+    void init_vec(const char *table_file);
+    void load_warm(const char *file_name, int binary);
 public:
     line_node();
     ~line_node();
     
+    friend class line_order;
     friend class line_hin;
     friend class line_adjacency;
     friend class line_trainer_line;
     friend class line_trainer_norm;
     friend class line_trainer_reg;
     friend class line_triple;
+    friend class line_partition;
     friend class line_regularizer_norm;
     friend class line_regularizer_line;
     
-    void init(const char *file_name, int vector_dim);
-    int search(char *word);
+    // warm_file is a checkpoint or an embedding file written by output with warm_binary:
+    // the nodes found there keep their vectors and the others are initialized randomly
+    // table_file keeps the rows in a file mapped into memory (see line_partition)
+    void init(const char *file_name, int vector_dim, int storage_type = LINE_STORAGE_FP32, const char *warm_file = NULL, int warm_binary = 0, const char *table_file = NULL);
+    // reuse the (read-only) vocabulary of p_node and only allocate new embeddings
+    void init(line_node *p_node, int vector_dim, int storage_type = LINE_STORAGE_FP32, const char *warm_file = NULL, int warm_binary = 0, const char *table_file = NULL);
+    int search(const char *word);
+    bool is_warm(int id) { return warm != NULL && warm[id]; }
+    // Move the row of vocabulary id to new_id[id]; search returns the new ids from
+    // then on and output still writes the nodes in vocabulary order. Must be called
+    // before any network or triple file is loaded on this node.
+    void reorder(int *new_id);
+    // identifies the vocabulary and the order of the rows
+    unsigned long long get_signature();
+    // binary: 0 text, 1 fp32, 2 the storage type as is
     void output(const char *file_name, int binary);
+    // Write the table in the line_checkpoint_header layout. The file is written
+    // under a temporary name and renamed, so an older checkpoint survives a crash.
+    void save_checkpoint(const char *file_name, long long step);
+    int get_storage() { return storage; }
+    // The rows of a table file are left empty by init, so that only the rows in use
+    // are ever touched. This initializes those of [begin, end) that are neither
+    // filled nor warm started; line_partition calls it when it loads a bucket.
+    void fill_rows(int begin, int end);
+    
+    // Row id as fp32. For fp32 storage this points into the table and buf is
+    // unused; otherwise the row is converted into buf (vector_size reals).
+    real *get_row(int id, real *buf)
+    {
+        if (storage == LINE_STORAGE_FP32) return _vec + (long long)id * vector_size;
+        unsigned short *src = _hvec + (long long)id * vector_size;
+        for (int c = 0; c != vector_size; c++) buf[c] = line_bf16_to_real(src[c]);
+        return buf;
+    }
+    // Write back a row obtained from get_row and refresh its norm.
+    void put_row(int id, real *row)
+    {
+        if (storage == LINE_STORAGE_FP32)
+        {
+            real *dst = _vec + (long long)id * vector_size;
+            if (row != dst) memcpy(dst, row, vector_size * sizeof(real));
+        }
+        else
+        {
+            unsigned short *dst = _hvec + (long long)id * vector_size;
+            for (int c = 0; c != vector_size; c++) dst[c] = line_real_to_bf16(row[c]);
+        }
+        _norm[id] = Eigen::Map<BLPVector>(row, vector_size).norm();
+    }
+    
+    // L2 norm of each row, cached so that scoring code does not reduce the row again.
+    // Whoever writes a row of vec must call update_norm on it afterwards.
+    real get_norm(int id) { return _norm[id]; }
+    void update_norm(int id)
+    {
+        if (storage == LINE_STORAGE_FP32) { _norm[id] = vec.row(id).norm(); return; }
+        real sum = 0, x;
+        unsigned short *src = _hvec + (long long)id * vector_size;
+        for (int c = 0; c != vector_size; c++) { x = line_bf16_to_real(src[c]); sum += x * x; }
+        _norm[id] = sqrt(sum);
+    }
+    void update_norm();
+    
+    void prefetch_row(int id)
+    {
+        char *row = storage == LINE_STORAGE_FP32 ? (char *)(_vec + (long long)id * vector_size) : (char *)(_hvec + (long long)id * vector_size);
+        int bytes = vector_size * (storage == LINE_STORAGE_FP32 ? sizeof(real) : sizeof(unsigned short));
+        for (int k = 0; k < bytes; k += 64) __builtin_prefetch(row + k, 1);
+        __builtin_prefetch(_norm + id, 1);
+    }
     
     //friend void linelib_output_batch(char *file_name, int binary, line_node **array_line_node, int cnt);
 };
 
+// Saves checkpoints of a few node tables from a background thread, so that
+// training does not wait for the disk. Rows are read while the trainers keep
+// updating them, so a checkpoint may mix rows from slightly different steps.
+class line_checkpoint
+{
+protected:
+    int node_cnt;
+    line_node *node[LINE_CHECKPOINT_MAX];
+    char file[LINE_CHECKPOINT_MAX][MAX_STRING];
+    long long step;
+    pthread_t thread;
+    bool started;
+    volatile int busy;
+    
+    static void *write_thread(void *p_checkpoint);
+public:
+    line_checkpoint();
+    ~line_checkpoint();
+    
+    void add(line_node *p_node, const char *file_name);
+    // start a checkpoint of every added node; false if the last one is still being written
+    bool start(long long cur_step);
+    void wait();
+};
+
+// one cache line per thread, written only by its thread
+struct line_scheduler_counter
+{
+    volatile long long samples;
+    char pad[56];
+};
+
+// Sample budget and learning rate of a run. The training threads add their
+// samples to their own counter every LINE_SCHEDULER_FLUSH samples and read the
+// learning rate back; a single monitor thread sums the counters every
+// LINE_SCHEDULER_TICK ms, decays the learning rate linearly over the budget
+// (down to 0.0001 of the start), prints the progress every
+// LINE_SCHEDULER_REPORT ticks and calls the hook, if any, with the samples done.
+class line_scheduler
+{
+protected:
+    long long total, epochs;
+    int num_threads;
+    real starting_alpha;
+    line_scheduler_counter *counter;
+    // written by the monitor only, away from the fields read with it
+    char pad0[64];
+    volatile real alpha;
+    volatile long long done;
+    volatile int running;
+    char pad1[64];
+    void (*hook)(long long cur_step);
+    pthread_t thread;
+    bool started;
+    
+    void tick(bool report);
+    static void *monitor_thread(void *p_scheduler);
+public:
+    line_scheduler();
+    ~line_scheduler();
+    
+    // epochs > 0 prints the progress in epochs of total / epochs samples
+    void init(long long p_total, real p_alpha, int p_num_threads, long long p_epochs = 0);
+    // samples of thread id when the threads share the budget; they sum to the total exactly
+    long long get_budget(int id);
+    // called by thread id only
+    void add(int id, long long cnt)
+    {
+        __atomic_store_n(&counter[id].samples, counter[id].samples + cnt, __ATOMIC_RELEASE);
+    }
+    real get_alpha() {return alpha;}
+    long long get_done() {return done;}
+    void start(void (*p_hook)(long long cur_step) = NULL);
+    // stop the monitor and print the final progress
+    void stop();
+};
+
+// Relabeling of a node table computed from the edges that touch it, so that
+// rows which are updated together sit in nearby cache lines and pages.
+// LINE_ORDER_DEGREE puts the nodes in order of decreasing degree;
+// LINE_ORDER_BFS walks the graph breadth first, starting from the hubs and
+// visiting neighbors by decreasing degree.
+class line_order
+{
+protected:
+    line_node *node;
+    std::vector<int> edge_u, edge_v;
+    int *new_id;
+public:
+    line_order();
+    ~line_order();
+    
+    void init(line_node *p_node);
+    // the first two columns of each line (head and tail, or u and v) form an edge
+    void add_file(const char *file_name);
+    void build(int mode);
+    // p_node must use the same vocabulary as the node given to init
+    void apply(line_node *p_node);
+};
+
 class line_hin
 {
 protected:
     char hin_file[MAX_STRING];
     
     line_node *node_u, *node_v;
-    std::vector<hin_nb> *hin;
     long long hin_size;
-    
+    bool typed;
+    
+    // Every edge is stored once per direction, sorted by (type, u) in the
+    // forward view and by (type, v) in the reverse view. Type t's edges leaving
+    // u are fw_id[fw_pst[t][u] .. fw_pst[t][u + 1]), and the offsets continue
+    // across types so that all views index the same arrays.
+    int type_size;
+    int type_index[256];
+    long long **fw_pst, **bw_pst, *empty_pst;
+    int *fw_id, *bw_id;
+    float *fw_wei, *bw_wei;
+    ransampl_csr **fw_smp;
+    
+    char *cache_map;
+    long long cache_size;
+    
+    long long *get_fw_pst(char edge_type);
+    long long *get_bw_pst(char edge_type);
+    ransampl_csr *get_fw_sampler(char edge_type);
 public:
     line_hin();
     ~line_hin();
@@ -112,6 +535,9 @@ public:
     friend class line_trainer_reg;
     
     void init(const char *file_name, line_node *p_u, line_node *p_v, bool with_type = 1);
+    // mmap a cache written by save_cache for the same file and nodes; false if it is missing or stale
+    bool load_cache(const char *cache_file, const char *file_name, line_node *p_u, line_node *p_v, bool with_type = 1);
+    void save_cache(const char *cache_file);
 };
 
 class line_adjacency
@@ -127,11 +553,12 @@ protected:
     double *u_wei;
     ransampl_ws *smp_u;
     
-    int *u_nb_cnt; int **u_nb_id; double **u_nb_wei;
-    ransampl_ws **smp_u_nb;
+    // borrowed from line_hin, except smp_v_nb whose weights depend on adjmode
+    long long *u_nb_pst; int *u_nb_id;
+    ransampl_csr *smp_u_nb;
     
-    int *v_nb_cnt; int **v_nb_id; double **v_nb_wei;
-    ransampl_ws **smp_v_nb;
+    long long *v_nb_pst; int *v_nb_id;
+    ransampl_csr *smp_v_nb;
     
 public:
     line_adjacency();
@@ -144,8 +571,8 @@ public:
     friend class line_regularizer_line;
     
     void init(line_hin *p_hin, char edge_type, int mode);
-    int sample(int u, double (*func_rand_num)());
-    int sample_head(double (*func_rand_num)());
+    int sample(int u, line_rng *rng);
+    int sample_head(line_rng *rng);
 };
 
 class line_trainer_line
@@ -153,23 +580,28 @@ class line_trainer_line
 protected:
     line_hin *phin;
     
-    int *u_nb_cnt; int **u_nb_id; double **u_nb_wei;
+    // borrowed from line_hin: neighbors of u are u_nb_id[u_nb_pst[u] .. u_nb_pst[u + 1])
+    long long *u_nb_pst; int *u_nb_id;
+    ransampl_csr *smp_u_nb;
     double *u_wei, *v_wei;
-    ransampl_ws *smp_u, **smp_u_nb;
+    ransampl_ws *smp_u;
     real *expTable;
-    int *neg_table;
+    // alias table over degree^0.75 of the v side; may be borrowed from another trainer
+    ransampl_ws *smp_neg;
+    bool neg_owner;
     
     char edge_tp;
     
     void train_uv(int u, int v, real lr, int neg_samples, real *_error_vec, unsigned long long &rand_index);
+    void train_batch(int cnt, int *target, int *label, real lr, real *_u, real *_error_vec, real *_block);
 public:
     line_trainer_line();
     ~line_trainer_line();
     
     void init(line_hin *p_hin, char edge_type);
     void copy_neg_table(line_trainer_line *p_trainer_line);
-    void train_sample(real lr, int neg_samples, real *_error_vec, double (*func_rand_num)(), unsigned long long &rand_index);
-    void train_sample_depth(real lr, int neg_samples, real *_error_vec, double (*func_rand_num)(), unsigned long long &rand_index, int depth, line_adjacency *p_adjacency, char pst);
+    void train_sample(real lr, int neg_samples, real *_error_vec, line_rng *rng, unsigned long long &rand_index, line_prefetch *pf = NULL);
+    void train_sample_depth(real lr, int neg_samples, real *_error_vec, line_rng *rng, unsigned long long &rand_index, int depth, line_adjacency *p_adjacency, char pst);
 };
 
 class line_trainer_norm
@@ -177,11 +609,14 @@ class line_trainer_norm
 protected:
     line_hin *phin;
     
-    int *u_nb_cnt; int **u_nb_id; double **u_nb_wei;
+    // borrowed from line_hin: neighbors of u are u_nb_id[u_nb_pst[u] .. u_nb_pst[u + 1])
+    long long *u_nb_pst; int *u_nb_id;
+    ransampl_csr *smp_u_nb;
     double *u_wei, *v_wei;
-    ransampl_ws *smp_u, **smp_u_nb;
+    ransampl_ws *smp_u;
     
     char edge_tp;
+    const line_kernel_set *kernel[3];
     
     void train_uv(int u, int v, real lr, real margin, int dis_type, real *_error_vec, double randv);
 public:
@@ -189,8 +624,8 @@ public:
     ~line_trainer_norm();
     
     void init(line_hin *p_hin, char edge_type);
-    void train_sample(real lr, real margin, int dis_type, real *_error_vec, double (*func_rand_num)());
-    void train_sample_depth(real lr, real margin, int dis_type, real *_error_vec, double (*func_rand_num)(), int depth, line_adjacency *p_adjacency, char pst);
+    void train_sample(real lr, real margin, int dis_type, real *_error_vec, line_rng *rng);
+    void train_sample_depth(real lr, real margin, int dis_type, real *_error_vec, line_rng *rng, int depth, line_adjacency *p_adjacency, char pst);
 };
 
 class line_trainer_reg
@@ -198,9 +633,11 @@ class line_trainer_reg
 protected:
     line_hin *phin;
     
-    int *u_nb_cnt; int **u_nb_id; double **u_nb_wei;
+    // borrowed from line_hin: neighbors of u are u_nb_id[u_nb_pst[u] .. u_nb_pst[u + 1])
+    long long *u_nb_pst; int *u_nb_id;
+    ransampl_csr *smp_u_nb;
     double *u_wei, *v_wei;
-    ransampl_ws *smp_u, **smp_u_nb;
+    ransampl_ws *smp_u;
     
     char edge_tp;
     
@@ -210,10 +647,12 @@ public:
     ~line_trainer_reg();
     
     void init(line_hin *p_hin, char edge_type);
-    void train_sample(real lr, double (*func_rand_num)());
-    void train_sample_depth(real lr, double (*func_rand_num)(), int depth, line_adjacency *p_adjacency, char pst);
+    void train_sample(real lr, line_rng *rng);
+    void train_sample_depth(real lr, line_rng *rng, int depth, line_adjacency *p_adjacency, char pst);
 };
 
+// Triples are stored grouped by relation, and sorted by head and tail within
+// a relation.
 class line_triple
 {
 protected:
@@ -221,39 +660,172 @@ protected:
     long long triple_size;
     int *triple_h, *triple_t, *triple_r;
     char triple_file[MAX_STRING];
-    std::set<triple> appear;
     
-    void train_ht(real lr, int dis_type, int h, int t, int r, int nh, int nt, int nr);
-    void update(line_node *node, int rowid, BLPVector &err);
+    // open-addressing set of all training triples, keyed on packed (h, r, t); its
+    // appear_size slots need not be a power of two
+    unsigned long long *appear;
+    long long appear_size;
+    
+    char *cache_map;
+    long long cache_size;
+    
+    // triples touching new or changed entities, drawn with probability focus_rate
+    long long *focus_id, focus_size;
+    real focus_rate;
+    
+    const line_kernel_set *kernel[3];
+    
+    // rows negatives are drawn from; an empty range means the whole node
+    int neg_h_begin, neg_h_end, neg_t_begin, neg_t_end;
+    // samples skipped for lack of a false corruption within LINE_NEG_TRIES draws
+    long long neg_skipped;
+    
+    unsigned long long triple_key(int h, int t, int r);
+    void add_appear(int h, int t, int r);
+    bool check_appear(int h, int t, int r);
+    long long draw_triple(line_rng *rng);
+    int draw_negative(bool corrupt_head, line_rng *rng);
+    // train the triple against a corrupted head or tail; neg is a candidate drawn beforehand, or -1
+    void train_corrupt(long long triple_id, bool corrupt_head, int neg, real lr, real margin, int dis_type, real *_error_vec, line_rng *rng);
+    void train_ht(real lr, int dis_type, int h, int t, int nh, int nt, real *_h, real *_t, real *_r, real *_nh, real *_nt, real *_error_vec);
+    void update(line_node *node, int rowid, real *_row, real *_err);
 public:
     line_triple();
     ~line_triple();
     
+    friend class line_triple_walker;
+    friend class line_partition;
+    
     void init(const char *file_name, line_node *p_h, line_node *p_t, line_node *p_r);
-    void train_sample(real lr, real margin, int dis_type, double (*func_rand_num)());
+    // mmap a cache written by save_cache for the same file and nodes; false if it is missing or stale
+    bool load_cache(const char *cache_file, const char *file_name, line_node *p_h, line_node *p_t, line_node *p_r);
+    void save_cache(const char *cache_file);
+    // Oversample the triples touching entities that were not warm started or, if
+    // old_file is given, that take part in a triple missing from it: train_sample
+    // draws from these triples with probability rate.
+    void set_focus(real rate, const char *old_file = NULL);
+    // draw corrupted heads from rows [h_begin, h_end) and tails from [t_begin, t_end)
+    void set_negative_range(int h_begin, int h_end, int t_begin, int t_end);
+    // _error_vec is caller-owned scratch space of 8 * vector_size reals
+    void train_sample(real lr, real margin, int dis_type, real *_error_vec, line_rng *rng, line_prefetch *pf = NULL);
+    void train_triple(long long triple_id, real lr, real margin, int dis_type, real *_error_vec, line_rng *rng);
+    // Train the cnt (at most bt->batch_size) triples ids, drawn like train_sample if
+    // ids is NULL, against one pool of bt->pool_size negatives shared by the batch.
+    void train_batch(line_triple_batch *bt, long long *ids, int cnt, real lr, real margin, int dis_type, line_rng *rng);
+    void prefetch(long long triple_id);
     long long get_triple_size();
+    long long get_neg_skipped();
+    // Set each relation row to the mean of t / |t| - h / |h| over its triples;
+    // relations without triples keep their rows.
     void update_relation();
 };
 
+// Walks the triples in epochs for one training thread. The triples are cut
+// into chunks of consecutive ones; thread id of num_threads owns every
+// num_threads-th chunk, visits its chunks in a new random order every epoch
+// and the triples of a chunk one after another, prefetching the rows of the
+// triple prefetch_ahead positions ahead.
+class line_triple_walker
+{
+protected:
+    line_triple *trip;
+    long long *index, first, last;
+    long long *chunk_list;
+    long long chunk_cnt, chunk_size, chunk_pos, pos, end;
+    int prefetch_ahead;
+public:
+    line_triple_walker();
+    ~line_triple_walker();
+    
+    void init(line_triple *p_trip, int id, int num_threads, long long chunk = 256, int ahead = 4);
+    // walk the triples index[begin .. end) only, e.g. one block of a line_partition
+    void init(line_triple *p_trip, long long *p_index, long long begin, long long end, int id, int num_threads, long long chunk = 256, int ahead = 4);
+    // number of triples this thread visits per epoch
+    long long get_size();
+    long long next(line_rng *rng);
+};
+
+// Trains the triples of one entity node block by block so that its table can
+// be kept in a file (line_node::init with a table file) larger than memory.
+// The rows are cut into parts buckets and the triples into the parts * parts
+// blocks of (head bucket, tail bucket). Only the buckets of the current block
+// have to be resident; while it is trained a background thread writes back and
+// drops the buckets no longer needed and reads in those of the next block.
+class line_partition
+{
+protected:
+    line_triple *trip;
+    line_node *node;
+    int parts, bucket_size;
+    // triple ids grouped by block, block b owning block_id[block_pst[b] .. block_pst[b + 1])
+    long long *block_pst, *block_id;
+    // non-empty blocks in training order, each sharing a bucket with the one before
+    int *block_list, block_cnt, next_block;
+    char *resident;
+    pthread_t thread;
+    bool started;
+    
+    static void *load_thread(void *arg);
+    void bucket_bytes(int b, long long *offset, long long *size);
+    void evict_bucket(int b);
+    void load_bucket(int b);
+public:
+    line_partition();
+    ~line_partition();
+    
+    void init(line_triple *p_trip, int p_parts);
+    int get_block_cnt();
+    // Wait until block k of the training order is resident, restrict the negatives
+    // to its buckets and start bringing in block k + 1 (block 0 after the last one).
+    // Returns the triple ids of the block in index[*begin .. *end).
+    long long *begin_block(int k, long long *begin, long long *end);
+    // wait for the background thread and write the whole table back
+    void finish();
+};
+
+// Scratch of one thread for line_triple::train_batch. Every triple of a batch
+// is compared with every negative of the pool: with the normalized rows stacked
+// into matrices the squared L2 distances and the summed margin gradients are
+// matrix products, L1 is done pair by pair. The gradients of a pool negative are
+// averaged over the pool, so one batch moves the rows as far as batch_size calls
+// of train_triple would on average.
+class line_triple_batch
+{
+protected:
+    int batch_size, pool_size, vector_size;
+    long long *id;
+    int *pool;
+    real *query, *resid, *err_h, *err_t, *pool_vec, *err_n, *score, *mask, *count, *pool_count, *buf;
+public:
+    line_triple_batch();
+    ~line_triple_batch();
+    
+    friend class line_triple;
+    
+    void init(int p_batch_size, int p_pool_size, int p_vector_size);
+    int get_batch_size() { return batch_size; }
+};
+
 class line_regularizer_line
 {
 protected:
     line_node *node;
     real *expTable;
     
-    void train_uv(real lr, int u, int v, int neg_samples, real *_error_vec, double (*func_rand_num)());
+    void train_uv(real lr, int u, int v, int neg_samples, real *_error_vec, line_rng *rng, line_prefetch *pf);
 public:
     line_regularizer_line();
     ~line_regularizer_line();
     
     void init(line_node *p_node);
-    void train_sample(real lr, int neg_samples, real *_error_vec, double (*func_rand_num)(), int depth, line_adjacency *p_adjacency);
+    void train_sample(real lr, int neg_samples, real *_error_vec, line_rng *rng, int depth, line_adjacency *p_adjacency, line_prefetch *pf = NULL);
 };
 
 class line_regularizer_norm
 {
 protected:
     line_node *node;
+    const line_kernel_set *kernel[3];
     
     void train_uv(real lr, int dis_type, int u, int v);
     void train_uv_neg(real lr, int dis_type, int u, int v, int n);
@@ -262,6 +834,6 @@ public:
     ~line_regularizer_norm();
     
     void init(line_node *p_node);
-    void train_sample(real lr, int dis_type, double (*func_rand_num)(), int depth, line_adjacency *p_adjacency);
-    void train_sample_neg(real lr, real margin, int dis_type, double (*func_rand_num)(), int depth, line_adjacency *p_adjacency);
+    void train_sample(real lr, int dis_type, line_rng *rng, int depth, line_adjacency *p_adjacency);
+    void train_sample_neg(real lr, real margin, int dis_type, line_rng *rng, int depth, line_adjacency *p_adjacency);
 };
\ No newline at end of file
@@ -18,57 +18,91 @@
 #include <math.h>
 #include <time.h>
 #include <pthread.h>
-#include <gsl/gsl_rng.h>
 #include "linelib.h"
 #include "ransampl.h"
 
 #define MAX_PATH_LENGTH 100
 
-char entity_file[MAX_STRING], relation_file[MAX_STRING], net_file[MAX_STRING], triple_file[MAX_STRING], output_en_file[MAX_STRING], output_rl_file[MAX_STRING];
-int binary = 0, num_threads = 1, vector_size = 100, negative = 5;
-long long samples = 1, edge_count_actual;
-real alpha = 0.025, starting_alpha;
-
-const gsl_rng_type * gsl_T;
-gsl_rng * gsl_r;
+char entity_file[MAX_STRING], relation_file[MAX_STRING], net_file[MAX_STRING], triple_file[MAX_STRING], output_en_file[MAX_STRING], output_rl_file[MAX_STRING], cache_prefix[MAX_STRING], checkpoint_prefix[MAX_STRING];
+char warm_en_file[MAX_STRING], warm_rl_file[MAX_STRING], warm_ct_file[MAX_STRING], old_triple_file[MAX_STRING];
+int binary = 0, storage = LINE_STORAGE_FP32, hugepage = LINE_HUGEPAGE_OFF, interleave = 0, order_mode = LINE_ORDER_NONE, num_threads = 1, vector_size = 100, negative = 5, numa = 0, prefetch_distance = 4;
+long long samples = 1, epochs = 0, checkpoint_interval = 600;
+time_t last_checkpoint;
+real alpha = 0.01, focus = 0;
 
 line_node node_w, node_c, node_r;
 line_hin hin_wc;
 line_trainer_line trainer_wc;
 line_triple trip_wc;
+line_checkpoint ckpt;
+line_scheduler sched;
 
-double func_rand_num()
+// called by the monitor thread of the scheduler
+void checkpoint_hook(long long cur_step)
 {
-    return gsl_rng_uniform(gsl_r);
+    if (time(NULL) - last_checkpoint < checkpoint_interval) return;
+    if (ckpt.start(cur_step)) last_checkpoint = time(NULL);
+}
+
+// file name of a -cache or -checkpoint prefix; a prefix too long for the name is an error
+void prefix_file_name(char *file_name, size_t size, const char *prefix, const char *suffix)
+{
+    int len = snprintf(file_name, size, "%s%s", prefix, suffix);
+    if (len < 0 || (size_t)len >= size)
+    {
+        printf("ERROR: prefix %s is too long!\n", prefix);
+        exit(1);
+    }
 }
 
 void *training_thread(void *id)
 {
-    long long edge_count = 0, last_edge_count = 0;
+    long long edge_count = 0, last_edge_count = 0, thread_samples = sched.get_budget((int)(long long)id);
+    real lr = sched.get_alpha();
+    line_rng rng;
+    line_triple_walker walker;
+    line_prefetch pf_wc, pf_trip;
+    pf_wc.init(prefetch_distance);
+    pf_trip.init(prefetch_distance);
+    int numa_node = numa > 0 ? line_numa_bind((int)(long long)id, num_threads) : 0;
+    rng.seed(314159265 + (long long)id);
+    if (epochs > 0)
+    {
+        walker.init(&trip_wc, (int)(long long)id, num_threads);
+        thread_samples = epochs * walker.get_size() * 10;
+    }
     unsigned long long next_random = (long long)id;
-    real *error_vec = (real *)calloc(vector_size, sizeof(real));
+    real *error_vec = (real *)calloc(8 * vector_size, sizeof(real));
     
     while (1)
     {
         //judge for exit
-        if (edge_count > samples / num_threads + 2) break;
+        if (edge_count >= thread_samples) break;
         
-        if (edge_count - last_edge_count > 1000)
+        if (edge_count - last_edge_count >= LINE_SCHEDULER_FLUSH)
         {
-            edge_count_actual += edge_count - last_edge_count;
+            sched.add((int)(long long)id, edge_count - last_edge_count);
+            if (numa > 0) line_numa_count(numa_node, edge_count - last_edge_count);
             last_edge_count = edge_count;
-            printf("%cAlpha: %f Progress: %.3lf%%", 13, alpha, (real)edge_count_actual / (real)(samples + 1) * 100);
-            fflush(stdout);
-            alpha = starting_alpha * (1 - edge_count_actual / (real)(samples + 1));
-            if (alpha < starting_alpha * 0.0001) alpha = starting_alpha * 0.0001;
+            lr = sched.get_alpha();
         }
         
-        for (int k = 0; k != 9; k++)
-        trainer_wc.train_sample(0.01, negative, error_vec, func_rand_num, next_random);
-        trip_wc.train_sample(0.01, 1, 2, func_rand_num);
+        // nine LINE samples and one triple; the last round is cut short so that the budget stays exact
+        int cnt = (int)std::min(10LL, thread_samples - edge_count);
+        for (int k = 0; k != std::min(cnt, 9); k++)
+        trainer_wc.train_sample(lr, negative, error_vec, &rng, next_random, &pf_wc);
+        if (cnt == 10)
+        {
+            if (epochs > 0) trip_wc.train_triple(walker.next(&rng), lr, 1, 2, error_vec, &rng);
+            else trip_wc.train_sample(lr, 1, 2, error_vec, &rng, &pf_trip);
+        }
         
-        edge_count += 10;
+        edge_count += cnt;
     }
+    sched.add((int)(long long)id, edge_count - last_edge_count);
+    if (numa > 0) line_numa_count(numa_node, edge_count - last_edge_count);
+    pf_wc.merge();
+    pf_trip.merge();
     free(error_vec);
     pthread_exit(NULL);
 }
@@ -76,30 +110,86 @@ void *training_thread(void *id)
 void TrainModel() {
     long a;
     pthread_t *pt = (pthread_t *)malloc(num_threads * sizeof(pthread_t));
-    starting_alpha = alpha;
     
-    gsl_rng_env_setup();
-    gsl_T = gsl_rng_rand48;
-    gsl_r = gsl_rng_alloc(gsl_T);
-    gsl_rng_set(gsl_r, 314159265);
+    // with threads bound to nodes, the tables are spread over all of them
+    if (numa > 0) line_numa_init();
+    line_mem_config(hugepage, interleave != 0 || (numa > 0 && line_numa_nodes() > 1));
+    line_load_config(num_threads);
     
-    node_w.init(entity_file, vector_size);
-    node_c.init(entity_file, vector_size);
-    node_r.init(relation_file, vector_size);
+    node_w.init(entity_file, vector_size, storage, warm_en_file[0] ? warm_en_file : NULL, binary);
+    node_c.init(&node_w, vector_size, storage, warm_ct_file[0] ? warm_ct_file : NULL, binary);
+    node_r.init(relation_file, vector_size, LINE_STORAGE_FP32, warm_rl_file[0] ? warm_rl_file : NULL, binary);
     
-    hin_wc.init(net_file, &node_w, &node_c, 0);
+    if (order_mode != LINE_ORDER_NONE)
+    {
+        line_order order;
+        order.init(&node_w);
+        order.add_file(net_file);
+        order.add_file(triple_file);
+        order.build(order_mode);
+        order.apply(&node_w);
+        order.apply(&node_c);
+    }
+    
+    if (cache_prefix[0] != 0)
+    {
+        char cache_file[MAX_STRING];
+        prefix_file_name(cache_file, sizeof(cache_file), cache_prefix, ".hin.bin");
+        if (!hin_wc.load_cache(cache_file, net_file, &node_w, &node_c, 0))
+        {
+            hin_wc.init(net_file, &node_w, &node_c, 0);
+            hin_wc.save_cache(cache_file);
+        }
+    }
+    else hin_wc.init(net_file, &node_w, &node_c, 0);
     
     trainer_wc.init(&hin_wc, 0);
     
-    trip_wc.init(triple_file, &node_w, &node_w, &node_r);
+    if (cache_prefix[0] != 0)
+    {
+        char cache_file[MAX_STRING];
+        prefix_file_name(cache_file, sizeof(cache_file), cache_prefix, ".triple.bin");
+        if (!trip_wc.load_cache(cache_file, triple_file, &node_w, &node_w, &node_r))
+        {
+            trip_wc.init(triple_file, &node_w, &node_w, &node_r);
+            trip_wc.save_cache(cache_file);
+        }
+    }
+    else trip_wc.init(triple_file, &node_w, &node_w, &node_r);
+    
+    if (epochs > 0) samples = epochs * trip_wc.get_triple_size() * 10;
+    if (focus > 0) trip_wc.set_focus(focus, old_triple_file[0] ? old_triple_file : NULL);
+    
+    if (checkpoint_prefix[0] != 0)
+    {
+        char ckpt_file[MAX_STRING];
+        prefix_file_name(ckpt_file, sizeof(ckpt_file), checkpoint_prefix, ".entity.ckpt");
+        ckpt.add(&node_w, ckpt_file);
+        prefix_file_name(ckpt_file, sizeof(ckpt_file), checkpoint_prefix, ".context.ckpt");
+        ckpt.add(&node_c, ckpt_file);
+        prefix_file_name(ckpt_file, sizeof(ckpt_file), checkpoint_prefix, ".relation.ckpt");
+        ckpt.add(&node_r, ckpt_file);
+        last_checkpoint = time(NULL);
+    }
+    line_mem_report();
     
     clock_t start = clock();
+    struct timespec wall_start, wall_finish;
+    clock_gettime(CLOCK_MONOTONIC, &wall_start);
     printf("Training:");
+    sched.init(samples, alpha, num_threads, epochs);
+    sched.start(checkpoint_prefix[0] != 0 ? checkpoint_hook : NULL);
     for (a = 0; a < num_threads; a++) pthread_create(&pt[a], NULL, training_thread, (void *)a);
     for (a = 0; a < num_threads; a++) pthread_join(pt[a], NULL);
+    sched.stop();
+    ckpt.wait();
     printf("\n");
     clock_t finish = clock();
+    clock_gettime(CLOCK_MONOTONIC, &wall_finish);
     printf("Total time: %lf\n", (double)(finish - start) / CLOCKS_PER_SEC);
+    line_prefetch_report();
+    if (trip_wc.get_neg_skipped() > 0) printf("Triples skipped without a false corruption: %lld\n", trip_wc.get_neg_skipped());
+    if (numa > 0) line_numa_report((wall_finish.tv_sec - wall_start.tv_sec) + (wall_finish.tv_nsec - wall_start.tv_nsec) / 1e9);
     
     node_w.output(output_en_file, binary);
     node_r.output(output_rl_file, binary);
@@ -132,19 +222,47 @@ int main(int argc, char **argv) {
         printf("\t-output <int>\n");
         printf("\t\tThe output file.\n");
         printf("\t-binary <int>\n");
-        printf("\t\tSave the resulting vectors in binary moded; default is 0 (off)\n");
+        printf("\t\tSave the resulting vectors in binary moded; default is 0 (off), 2 keeps the storage type\n");
+        printf("\t-storage <int>\n");
+        printf("\t\tStorage of the entity vectors: 0 fp32, 1 bf16; default is 0\n");
+        printf("\t-hugepage <int>\n");
+        printf("\t\tBack large tables with huge pages: 0 off, 1 transparent, 2 explicit (falls back to 1); default is 0\n");
+        printf("\t-interleave <int>\n");
+        printf("\t\tInterleave large tables over NUMA nodes; default is 0 (off)\n");
+        printf("\t-numa <int>\n");
+        printf("\t\tBind each thread to a NUMA node, interleave the tables over the nodes and report the throughput per node; default is 0 (off)\n");
+        printf("\t-prefetch <int>\n");
+        printf("\t\tDraw this many samples ahead and prefetch their rows; default is 4, 0 draws each sample when it is used\n");
+        printf("\t-order <int>\n");
+        printf("\t\tRelabel entities before training: 0 file order, 1 by degree, 2 breadth first from the hubs; default is 0\n");
         printf("\t-size <int>\n");
         printf("\t\tSet size of word vectors; default is 100\n");
         printf("\t-negative <int>\n");
         printf("\t\tNumber of negative examples; default is 5, common values are 5 - 10 (0 = not used)\n");
         printf("\t-samples <int>\n");
         printf("\t\tSet the number of training samples as <int>Million\n");
+        printf("\t-epochs <int>\n");
+        printf("\t\tTrain for <int> passes over the triples instead of -samples; default is 0 (use -samples)\n");
+        printf("\t-checkpoint <prefix>\n");
+        printf("\t\tPeriodically save the embeddings to <prefix>.*.ckpt in the background\n");
+        printf("\t-checkpoint-interval <int>\n");
+        printf("\t\tSeconds between two checkpoints; default is 600\n");
+        printf("\t-warm-en <file>\n");
+        printf("\t\tStart from the entity vectors in <file> (a checkpoint, or an output file written with the same -binary); new entities are initialized randomly\n");
+        printf("\t-warm-ct <file>\n");
+        printf("\t\tStart from the context vectors in <file> (a checkpoint file)\n");
+        printf("\t-warm-rl <file>\n");
+        printf("\t\tStart from the relation vectors in <file>\n");
+        printf("\t-old-triple <file>\n");
+        printf("\t\tThe triple file of the warm start run; entities in triples missing from it count as changed\n");
+        printf("\t-focus <float>\n");
+        printf("\t\tDraw this fraction of the triples from those touching new or changed entities; default is 0\n");
         printf("\t-iters <int>\n");
         printf("\t\tSet the number of interations.\n");
         printf("\t-threads <int>\n");
         printf("\t\tUse <int> threads (default 1)\n");
         printf("\t-alpha <float>\n");
-        printf("\t\tSet the starting learning rate; default is 0.025\n");
+        printf("\t\tSet the starting learning rate; default is 0.01\n");
         printf("\nExamples:\n");
         printf("./hin2vec -node node.txt -link link.txt -path path.txt -output vec.emb -binary 1 -size 100 -negative 5 -samples 5 -iters 20 -threads 12\n\n");
         return 0;
@@ -155,10 +273,25 @@ int main(int argc, char **argv) {
     if ((i = ArgPos((char *)"-triple", argc, argv)) > 0) strcpy(triple_file, argv[i + 1]);
     if ((i = ArgPos((char *)"-output-en", argc, argv)) > 0) strcpy(output_en_file, argv[i + 1]);
     if ((i = ArgPos((char *)"-output-rl", argc, argv)) > 0) strcpy(output_rl_file, argv[i + 1]);
+    if ((i = ArgPos((char *)"-cache", argc, argv)) > 0) strcpy(cache_prefix, argv[i + 1]);
+    if ((i = ArgPos((char *)"-checkpoint", argc, argv)) > 0) strcpy(checkpoint_prefix, argv[i + 1]);
+    if ((i = ArgPos((char *)"-checkpoint-interval", argc, argv)) > 0) checkpoint_interval = atoll(argv[i + 1]);
     if ((i = ArgPos((char *)"-binary", argc, argv)) > 0) binary = atoi(argv[i + 1]);
+    if ((i = ArgPos((char *)"-storage", argc, argv)) > 0) storage = atoi(argv[i + 1]);
+    if ((i = ArgPos((char *)"-hugepage", argc, argv)) > 0) hugepage = atoi(argv[i + 1]);
+    if ((i = ArgPos((char *)"-interleave", argc, argv)) > 0) interleave = atoi(argv[i + 1]);
+    if ((i = ArgPos((char *)"-numa", argc, argv)) > 0) numa = atoi(argv[i + 1]);
+    if ((i = ArgPos((char *)"-prefetch", argc, argv)) > 0) prefetch_distance = atoi(argv[i + 1]);
+    if ((i = ArgPos((char *)"-order", argc, argv)) > 0) order_mode = atoi(argv[i + 1]);
     if ((i = ArgPos((char *)"-size", argc, argv)) > 0) vector_size = atoi(argv[i + 1]);
     if ((i = ArgPos((char *)"-negative", argc, argv)) > 0) negative = atoi(argv[i + 1]);
     if ((i = ArgPos((char *)"-samples", argc, argv)) > 0) samples = (long long)(atof(argv[i + 1])*1000000);
+    if ((i = ArgPos((char *)"-epochs", argc, argv)) > 0) epochs = atoll(argv[i + 1]);
+    if ((i = ArgPos((char *)"-warm-en", argc, argv)) > 0) strcpy(warm_en_file, argv[i + 1]);
+    if ((i = ArgPos((char *)"-warm-ct", argc, argv)) > 0) strcpy(warm_ct_file, argv[i + 1]);
+    if ((i = ArgPos((char *)"-warm-rl", argc, argv)) > 0) strcpy(warm_rl_file, argv[i + 1]);
+    if ((i = ArgPos((char *)"-old-triple", argc, argv)) > 0) strcpy(old_triple_file, argv[i + 1]);
+    if ((i = ArgPos((char *)"-focus", argc, argv)) > 0) focus = atof(argv[i + 1]);
     if ((i = ArgPos((char *)"-alpha", argc, argv)) > 0) alpha = atof(argv[i + 1]);
     if ((i = ArgPos((char *)"-threads", argc, argv)) > 0) num_threads = atoi(argv[i + 1]);
     TrainModel();
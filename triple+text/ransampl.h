@@ -14,6 +14,7 @@
 
 #ifndef RANSAMPL_H
 #define RANSAMPL_H
+#include <stddef.h>
 #undef __BEGIN_DECLS
 #undef __END_DECLS
 #ifdef __cplusplus
@@ -27,6 +28,10 @@ __BEGIN_DECLS
 
 typedef long long integer;
 
+/* Allocator for the alias tables themselves (not the workspace structs or
+ * the temporary lists used while building them); defaults to malloc/free. */
+void ransampl_set_allocator( void* (*alloc)( size_t size ), void (*dealloc)( void *ptr ) );
+
 typedef struct {
     integer n;
     integer* alias;
@@ -41,5 +46,29 @@ integer ransampl_draw( ransampl_ws *ws, double ran1, double ran2 );
 
 void ransampl_free( ransampl_ws *ws );
 
+/* Many small alias tables stored back to back, one group per CSR row.
+ * Group k owns entries [pst[k], pst[k+1]); pst[0] need not be zero, so the
+ * offsets may index a slice of a larger edge array. A cell keeps its
+ * probability and its alias together so that a draw reads a single cache line. */
+
+typedef struct {
+    float prob;
+    int alias;
+} ransampl_cell;
+
+typedef struct {
+    integer n;
+    integer* pst;
+    ransampl_cell* cell;
+} ransampl_csr;
+
+ransampl_csr* ransampl_csr_alloc( integer n, integer *pst );
+
+void ransampl_csr_set( ransampl_csr *ws, double *p );
+
+integer ransampl_csr_draw( ransampl_csr *ws, integer k, double ran1, double ran2 );
+
+void ransampl_csr_free( ransampl_csr *ws );
+
 __END_DECLS
 #endif /* RANSAMPL_H */
@@ -19,13 +19,23 @@
 #include <errno.h>
 #include "ransampl.h"
 
+static void* (*ransampl_table_alloc)( size_t size ) = malloc;
+static void (*ransampl_table_free)( void *ptr ) = free;
+
+//! Route the allocation of alias tables through another allocator.
+void ransampl_set_allocator( void* (*alloc)( size_t size ), void (*dealloc)( void *ptr ) )
+{
+    ransampl_table_alloc = alloc;
+    ransampl_table_free = dealloc;
+}
+
 //! Allocate workspace for random-number sampling.
 ransampl_ws* ransampl_alloc( integer n )
 {
     ransampl_ws *ws;
 	ws = (ransampl_ws *)malloc(sizeof(ransampl_ws));
-	ws->alias = (integer *)malloc(n*sizeof(integer));
-	ws->prob = (double *)malloc(n*sizeof(double));
+	ws->alias = (integer *)ransampl_table_alloc(n*sizeof(integer));
+	ws->prob = (double *)ransampl_table_alloc(n*sizeof(double));
 	if (ws == NULL || ws->alias == NULL || ws->prob == NULL)
 	{
         fprintf( stderr, "ransampl: workspace allocation failed\n" );
@@ -117,7 +127,120 @@ integer ransampl_draw( ransampl_ws *ws, double ran1, double ran2 )
 //! Free the random-number sampling workspace.
 void ransampl_free( ransampl_ws *ws )
 {
-    free( ws->alias );
-    free( ws->prob );
+    ransampl_table_free( ws->alias );
+    ransampl_table_free( ws->prob );
+    free( ws );
+}
+
+//! Allocate n alias tables in one block; pst has n+1 CSR offsets and is borrowed.
+ransampl_csr* ransampl_csr_alloc( integer n, integer *pst )
+{
+    ransampl_csr *ws;
+    ws = (ransampl_csr *)malloc(sizeof(ransampl_csr));
+    if (ws == NULL)
+    {
+        fprintf( stderr, "ransampl: workspace allocation failed\n" );
+        exit(ENOMEM);
+    }
+    ws->cell = (ransampl_cell *)ransampl_table_alloc((pst[n] > pst[0] ? pst[n] - pst[0] : 1)*sizeof(ransampl_cell));
+    if (ws->cell == NULL)
+    {
+        fprintf( stderr, "ransampl: workspace allocation failed\n" );
+        exit(ENOMEM);
+    }
+    ws->n = n;
+    ws->pst = pst;
+    return ws;
+}
+
+//! Build every group from the weights p[0 .. pst[n]-pst[0]), sharing one scratch buffer.
+void ransampl_csr_set( ransampl_csr *ws, double *p )
+{
+    integer k, i, a, g, m, max_m = 0;
+
+    for ( k=0; k<ws->n; ++k )
+        if ( ws->pst[k+1]-ws->pst[k] > max_m )
+            max_m = ws->pst[k+1]-ws->pst[k];
+
+    double *P;
+    integer *S, *L;
+    if ( !(P = (double*) malloc( (max_m+1)*sizeof(double) ) ) ||
+         !(S = (integer*) malloc( (max_m+1)*sizeof(integer) ) ) ||
+         !(L = (integer*) malloc( (max_m+1)*sizeof(integer) ) ) ) {
+        fprintf( stderr, "ransampl: temporary allocation failed\n" );
+        exit(ENOMEM);
+    }
+
+    for ( k=0; k<ws->n; ++k ) {
+        integer base = ws->pst[k] - ws->pst[0];
+        double *q = p + base;
+        ransampl_cell *cell = ws->cell + base;
+        m = ws->pst[k+1] - ws->pst[k];
+        if ( !m ) continue;
+
+        // same normalisation and list processing as ransampl_set
+        double sum=0;
+        for ( i=0; i<m; ++i ) {
+            if ( q[i]<0 ) q[i] = 0;
+            sum += q[i];
+        }
+        if ( !sum ) {
+            for ( i=0; i<m; ++i ) q[i] = 1;
+            sum = m;
+        }
+        for ( i=0; i<m; ++i )
+            P[i] = q[i] * m / sum;
+
+        integer nS = 0, nL = 0;
+        for ( i=m-1; i>=0; --i ) {
+            if ( P[i]<1 )
+                S[nS++] = i;
+            else
+                L[nL++] = i;
+        }
+
+        while ( nS && nL ) {
+            a = S[--nS];
+            g = L[--nL];
+            cell[a].prob = (float)P[a];
+            cell[a].alias = (int)g;
+            P[g] = P[g] + P[a] - 1;
+            if ( P[g] < 1 )
+                S[nS++] = g;
+            else
+                L[nL++] = g;
+        }
+
+        while ( nL ) {
+            a = L[--nL];
+            cell[a].prob = 1;
+            cell[a].alias = (int)a;
+        }
+
+        while ( nS ) {
+            a = S[--nS];
+            cell[a].prob = 1;
+            cell[a].alias = (int)a;
+        }
+    }
+
+    free( P );
+    free( S );
+    free( L );
+}
+
+//! Draw one index of group k, returned as a global offset into the CSR arrays.
+integer ransampl_csr_draw( ransampl_csr *ws, integer k, double ran1, double ran2 )
+{
+    integer base = ws->pst[k];
+    integer i = (integer) ((ws->pst[k+1] - base) * ran1);
+    ransampl_cell c = ws->cell[base - ws->pst[0] + i];
+    return base + (ran2 < c.prob ? i : c.alias);
+}
+
+//! Free the grouped workspace (the borrowed offsets are left alone).
+void ransampl_csr_free( ransampl_csr *ws )
+{
+    ransampl_table_free( ws->cell );
     free( ws );
 }